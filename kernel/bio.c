@@ -20,11 +20,13 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "proc.h"
 #include "buf.h"
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  uint bsize;  // block size of the disk
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -36,6 +38,7 @@ void binit(void) {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  bcache.bsize = MINBSIZE;
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
@@ -44,6 +47,7 @@ void binit(void) {
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
+    b->size = bcache.bsize;
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
@@ -83,6 +87,23 @@ static struct buf *bget(uint dev, uint blockno) {
   panic("bget: no buffers");
 }
 
+// Switch to blocks of bsize bytes, discarding all cached
+// blocks, which were read with the old size. Called by
+// fsinit() once it knows the block size, before any buffer
+// is held.
+void bsetsize(uint bsize) {
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  bcache.bsize = bsize;
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    if (b->refcnt != 0) panic("bsetsize");
+    b->valid = 0;
+    b->size = bsize;
+  }
+  release(&bcache.lock);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf *bread(uint dev, uint blockno) {
   struct buf *b;
@@ -91,6 +112,7 @@ struct buf *bread(uint dev, uint blockno) {
   if (!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
+    if (myproc()) myproc()->inblock++;
   }
   return b;
 }
@@ -99,6 +121,7 @@ struct buf *bread(uint dev, uint blockno) {
 void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("bwrite");
   virtio_disk_rw(b, 1);
+  if (myproc()) myproc()->oublock++;
 }
 
 // Release a locked buffer.
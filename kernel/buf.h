@@ -3,6 +3,7 @@ struct buf {
   int disk;    // does disk "own" buf?
   uint dev;
   uint blockno;
+  uint size;   // block size: bytes of data[] in use
   struct sleeplock lock;
   uint refcnt;
   struct buf *prev; // LRU cache list
@@ -4,9 +4,13 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct rusage;
 struct spinlock;
 struct sleeplock;
+struct spawnfa;
 struct stat;
+struct statfs;
+struct iovec;
 struct superblock;
 
 // bio.c
@@ -14,6 +18,7 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bsetsize(uint);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -24,6 +29,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -31,13 +37,21 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+int             filereadv(struct file*, struct iovec*, int);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewritev(struct file*, struct iovec*, int);
+int             filesend(struct file*, struct file*, uint*, int);
+int             filepread(struct file*, uint64, int, uint);
+int             filepwrite(struct file*, uint64, int, uint);
+int             fileseek(struct file*, int, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dirunlink(struct inode*, char*, uint);
+int             isdirempty(struct inode*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
@@ -50,10 +64,16 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             sendi(struct inode*, uint, uint, int (*)(void*, char*, int), void*);
 void            stati(struct inode*, struct stat*);
+void            fsstat(struct statfs*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
+// futex.c
+void            futexinit(void);
+int             futex(uint64, int, int);
+
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
@@ -67,14 +87,29 @@ void            kinit(void);
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+void            log_free(int);
+int             log_freed(int);
+void            log_commit(void);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+
+// mmap.c
+uint64          mmap(struct proc*, uint64, int, int, struct file*, uint64);
+int             mmapcopy(struct proc*, struct proc*);
+int             mmapfault(struct proc*, uint64, int);
+uint64          mmaplow(struct proc*);
+void            mmapprefault(uint64, uint64, int);
+int             munmap(struct proc*, uint64, uint64);
+void            munmapall(struct proc*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 #ifdef TEST
@@ -88,24 +123,38 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+void            boost(void);
+int             clone(uint64, uint64, uint64);
 int             cpuid(void);
 void            exit(int);
+int             getaffinity(int, uint64*);
 int             fork(void);
-int             growproc(int);
+uint64          growproc(int);
+int             join(int, uint64);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kickcpu(int, uint64);
+void            shootdown(struct proc*);
+void            kproc(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
+int             preempt(void);
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setaffinity(int, uint64);
+int             spawn(char*, char**, struct spawnfa*, int);
+void            settimer(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
-int             wait(uint64);
+int             wait(uint64, uint64);
+void            chargetime(struct proc*, int);
+void            getrusage(struct proc*, struct rusage*);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -150,8 +199,18 @@ extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
+void            clockintr(void);
 void            usertrapret(void);
 
+// timer.c
+void            wheelinit(void);
+void            timertick(void);
+void            timerfine(void);
+int             sleepticks(uint64);
+uint64          timerdue(void);
+uint64          mtime(void);
+int             nanosleep(uint64);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -173,6 +232,9 @@ int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+void            uvminval(pagetable_t, uint64, uint64);
+void            uvmfreeinval(pagetable_t, uint64, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
@@ -10,6 +11,18 @@
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
 int exec(char *path, char **argv) {
+  struct proc *p = myproc();
+
+  // The threads of a process would be left without memory.
+  if (p->mm != p || p->nthread > 0) return -1;
+  return execinto(p, path, argv);
+}
+
+// Replace p's user memory with the program at path, started with
+// arguments argv. p is the current process, or a new one that
+// spawn() is setting up. Returns argc, or -1 with p's memory
+// unchanged.
+int execinto(struct proc *p, char *path, char **argv) {
   char *s, *last;
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG + 1], stackbase;
@@ -17,7 +30,6 @@ int exec(char *path, char **argv) {
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -49,7 +61,6 @@ int exec(char *path, char **argv) {
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -90,6 +101,7 @@ int exec(char *path, char **argv) {
   safestrcpy(p->name, last, sizeof(p->name));
 
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
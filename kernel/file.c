@@ -12,6 +12,10 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "uio.h"
+#include "fcntl.h"
+
+extern struct superblock sb;  // fs.c
 
 struct devsw devsw[NDEV];
 struct {
@@ -86,68 +90,285 @@ int filestat(struct file *f, uint64 addr) {
   return -1;
 }
 
+// Read inode file f at *off into the n buffers of iov, which
+// are in user memory, advancing *off.
+static int inoderead(struct file *f, struct iovec *iov, int n, uint *off) {
+  int r, tot = 0;
+
+  for (int i = 0; i < n; i++) mmapprefault((uint64)iov[i].iov_base, iov[i].iov_len, 1);
+  ilock(f->ip);
+  myproc()->nofault = 1;
+  for (int i = 0; i < n; i++) {
+    if ((r = readi(f->ip, 1, (uint64)iov[i].iov_base, *off, iov[i].iov_len)) > 0) *off += r;
+    tot += r;
+    if (r != iov[i].iov_len) break;
+  }
+  myproc()->nofault = 0;
+  iunlock(f->ip);
+  return tot;
+}
+
+// Write the n buffers of iov, which are in user memory, to inode
+// file f at *off, advancing *off. Buffers share log
+// transactions, so a gather of small writes commits once.
+static int inodewrite(struct file *f, struct iovec *iov, int n, uint *off) {
+  int r = 0, tot = 0, left = 0;
+
+  for (int i = 0; i < n; i++) {
+    left += iov[i].iov_len;
+    mmapprefault((uint64)iov[i].iov_base, iov[i].iov_len, 0);
+  }
+
+  // write as many blocks at a time as fit in the log,
+  // reserving room for each data block and its
+  // allocation block, plus the i-node, indirect block,
+  // and 2 blocks of slop for non-aligned writes. small
+  // writes reserve less, so more of them fit alongside.
+  // the buffers land back to back in the file, so
+  // a transaction may take several of them.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((LOGSIZE - 1 - 1 - 2) / 2) * sb.bsize;
+  int i = 0, done = 0;
+  while (left > 0) {
+    int m = 0, want = left < max ? left : max;
+    int nblocks = 1 + 1 + 2 + 2 * ((want + sb.bsize - 1) / sb.bsize);
+
+    begin_opn(nblocks);
+    ilock(f->ip);
+    myproc()->nofault = 1;
+    while (i < n && m < want) {
+      int n1 = iov[i].iov_len - done;
+      if (n1 > want - m) n1 = want - m;
+      if ((r = writei(f->ip, 1, (uint64)iov[i].iov_base + done, *off, n1)) > 0) *off += r;
+      if (r != n1) {
+        // error, or the disk is full
+        r = -1;
+        break;
+      }
+      m += r;
+      tot += r;
+      if ((done += r) == iov[i].iov_len) {
+        i++;
+        done = 0;
+      }
+    }
+    myproc()->nofault = 0;
+    iunlock(f->ip);
+    end_opn(nblocks);
+
+    if (r < 0) return -1;
+    left -= m;
+  }
+  if (f->sync) log_commit();
+  return tot;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int fileread(struct file *f, uint64 addr, int n) {
-  int r = 0;
+  struct iovec iov = {(void *)addr, n};
+
+  return filereadv(f, &iov, 1);
+}
+
+// Read from file f into the n buffers of iov, which are in user
+// memory. A pipe or device read stops after the first buffer
+// that receives any data, rather than wait to fill the rest.
+int filereadv(struct file *f, struct iovec *iov, int n) {
+  int r, tot = 0;
 
   if (f->readable == 0) return -1;
 
-  if (f->type == FD_PIPE) {
-    r = piperead(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read) return -1;
-    r = devsw[f->major].read(1, addr, n);
+  if (f->type == FD_PIPE || f->type == FD_DEVICE) {
+    if (f->type == FD_DEVICE && (f->major < 0 || f->major >= NDEV || !devsw[f->major].read)) return -1;
+    // Pipes and the console copy out holding a spin-lock.
+    for (int i = 0; i < n; i++) mmapprefault((uint64)iov[i].iov_base, iov[i].iov_len, 1);
+    for (int i = 0; i < n && tot == 0; i++) {
+      if (iov[i].iov_len == 0) continue;
+      if (f->type == FD_PIPE)
+        r = piperead(f->pipe, (uint64)iov[i].iov_base, iov[i].iov_len);
+      else
+        r = devsw[f->major].read(1, (uint64)iov[i].iov_base, iov[i].iov_len);
+      if (r < 0) return -1;
+      tot += r;
+    }
   } else if (f->type == FD_INODE) {
-    ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0) f->off += r;
-    iunlock(f->ip);
+    tot = inoderead(f, iov, n, &f->off);
   } else {
     panic("fileread");
   }
 
-  return r;
+  return tot;
 }
 
 // Write to file f.
 // addr is a user virtual address.
 int filewrite(struct file *f, uint64 addr, int n) {
-  int r, ret = 0;
+  struct iovec iov = {(void *)addr, n};
+
+  return filewritev(f, &iov, 1);
+}
+
+// Write the n buffers of iov, which are in user memory, to f.
+int filewritev(struct file *f, struct iovec *iov, int n) {
+  int r, tot = 0;
 
   if (f->writable == 0) return -1;
 
-  if (f->type == FD_PIPE) {
-    ret = pipewrite(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write) return -1;
-    ret = devsw[f->major].write(1, addr, n);
-  } else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max) n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0) f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if (r < 0) break;
-      if (r != n1) panic("short filewrite");
-      i += r;
+  if (f->type == FD_PIPE || f->type == FD_DEVICE) {
+    if (f->type == FD_DEVICE && (f->major < 0 || f->major >= NDEV || !devsw[f->major].write)) return -1;
+    // Pipes and the console copy in holding a spin-lock.
+    for (int i = 0; i < n; i++) mmapprefault((uint64)iov[i].iov_base, iov[i].iov_len, 0);
+    for (int i = 0; i < n; i++) {
+      if (f->type == FD_PIPE)
+        r = pipewrite(f->pipe, 1, (uint64)iov[i].iov_base, iov[i].iov_len);
+      else
+        r = devsw[f->major].write(1, (uint64)iov[i].iov_base, iov[i].iov_len);
+      if (r < 0) return tot > 0 ? tot : -1;
+      tot += r;
+      if (r != iov[i].iov_len) break;
     }
-    ret = (i == n ? n : -1);
+  } else if (f->type == FD_INODE) {
+    tot = inodewrite(f, iov, n, &f->off);
   } else {
     panic("filewrite");
   }
 
-  return ret;
+  return tot;
+}
+
+// Read n bytes of inode file f at offset off into user
+// address addr, leaving f's offset alone.
+int filepread(struct file *f, uint64 addr, int n, uint off) {
+  struct iovec iov = {(void *)addr, n};
+
+  if (f->readable == 0 || f->type != FD_INODE) return -1;
+  return inoderead(f, &iov, 1, &off);
+}
+
+// Write n bytes from user address addr to inode file f at
+// offset off, leaving f's offset alone.
+int filepwrite(struct file *f, uint64 addr, int n, uint off) {
+  struct iovec iov = {(void *)addr, n};
+
+  if (f->writable == 0 || f->type != FD_INODE) return -1;
+  return inodewrite(f, &iov, 1, &off);
+}
+
+// Set the offset of inode file f, relative to whence.
+// There are no holes in xv6 files, so the offset may not
+// be past the end. Returns the new offset, or -1.
+int fileseek(struct file *f, int off, int whence) {
+  int base;
+
+  if (f->type != FD_INODE) return -1;
+  ilock(f->ip);
+  if (whence == SEEK_SET)
+    base = 0;
+  else if (whence == SEEK_CUR)
+    base = f->off;
+  else if (whence == SEEK_END)
+    base = f->ip->size;
+  else
+    base = -1;
+  if (base < 0 || base + off < 0 || base + off > f->ip->size) {
+    iunlock(f->ip);
+    return -1;
+  }
+  f->off = base + off;
+  iunlock(f->ip);
+  return f->off;
+}
+
+// Consumer of sendi() data for filesend() to an inode file.
+static int sendinode(void *arg, char *src, int n) {
+  struct file *f = arg;
+  int r;
+
+  if ((r = writei(f->ip, 0, (uint64)src, f->off, n)) > 0) f->off += r;
+  return r;
+}
+
+// Copy up to n bytes of inode file in, starting at *off, to pipe
+// or device out, a block at a time through a bounce page. Writing
+// a pipe or device may sleep until a reader drains it, which must
+// not happen with in's inode or a buffer locked, so each block is
+// read with ilock() and written after iunlock(). Advances *off.
+// Returns the number of bytes written, or -1 if none were and the
+// write failed.
+static int sendcopy(struct file *out, struct file *in, uint *off, int n) {
+  char *page;
+  int r, w, tot = 0;
+
+  if ((page = kalloc()) == 0) return -1;
+  while (tot < n) {
+    r = n - tot < sb.bsize - *off % sb.bsize ? n - tot : sb.bsize - *off % sb.bsize;
+    ilock(in->ip);
+    r = readi(in->ip, 0, (uint64)page, *off, r);
+    iunlock(in->ip);
+    if (r <= 0) break;
+    if (out->type == FD_PIPE)
+      w = pipewrite(out->pipe, 0, (uint64)page, r);
+    else
+      w = devsw[out->major].write(0, (uint64)page, r);
+    if (w < 0) {
+      if (tot == 0) tot = -1;
+      break;
+    }
+    *off += w;
+    tot += w;
+    if (w != r) break;
+  }
+  kfree(page);
+  return tot;
+}
+
+// Copy up to n bytes of inode file in, starting at *off, to out,
+// without a user buffer: to an inode file straight from the buffer
+// cache, and to a pipe or device through a bounce page (see
+// sendcopy()). Advances *off.
+// Returns the number of bytes copied, or -1.
+int filesend(struct file *out, struct file *in, uint *off, int n) {
+  struct inode *a, *b;
+  int r, m, tot;
+
+  if (in->readable == 0 || out->writable == 0 || in->type != FD_INODE) return -1;
+  if (out->type == FD_DEVICE && (out->major < 0 || out->major >= NDEV || !devsw[out->major].write)) return -1;
+  // sendi() holds in's blocks while writei() reads out's.
+  if (out->type == FD_INODE && out->ip == in->ip) return -1;
+
+  // Like inodewrite(), copy as much per log transaction as fits.
+  int max = ((LOGSIZE - 1 - 1 - 2) / 2) * sb.bsize;
+  for (tot = 0; tot < n; tot += r) {
+    m = n - tot;
+    if (m > max) m = max;
+
+    if (out->type == FD_INODE) {
+      int nblocks = 1 + 1 + 2 + 2 * ((m + sb.bsize - 1) / sb.bsize);
+      // Lock the two inodes in a fixed order.
+      a = in->ip < out->ip ? in->ip : out->ip;
+      b = in->ip < out->ip ? out->ip : in->ip;
+      begin_opn(nblocks);
+      ilock(a);
+      ilock(b);
+      if ((r = sendi(in->ip, *off, m, sendinode, out)) > 0) *off += r;
+      iunlock(b);
+      iunlock(a);
+      end_opn(nblocks);
+    } else {
+      r = sendcopy(out, in, off, m);
+    }
+
+    if (r < 0) {
+      if (tot == 0) tot = -1;
+      break;
+    }
+    if (r != m) {
+      tot += r;
+      break;
+    }
+  }
+  if (out->type == FD_INODE && out->sync) log_commit();
+  return tot;
 }
@@ -15,8 +15,8 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -26,55 +26,87 @@
 // only one device
 struct superblock sb;
 
-// Read the super block.
-static void readsb(int dev, struct superblock *sb) {
+// Read the super block, which is at byte SBOFF whatever the
+// block size, reading blocks of bsize bytes.
+static void readsb(int dev, uint bsize, struct superblock *sb) {
   struct buf *bp;
 
-  bp = bread(dev, 1);
-  memmove(sb, bp->data, sizeof(*sb));
+  bp = bread(dev, SBOFF / bsize);
+  memmove(sb, bp->data + SBOFF % bsize, sizeof(*sb));
   brelse(bp);
 }
 
 // Init fs
 void fsinit(int dev) {
-  readsb(dev, &sb);
+  // Read the super block with the smallest block size, to find
+  // out the real one.
+  readsb(dev, MINBSIZE, &sb);
   if (sb.magic != FSMAGIC) panic("invalid file system");
+  if (sb.bsize < MINBSIZE || sb.bsize > BSIZE || (sb.bsize & (sb.bsize - 1)) != 0) panic("invalid block size");
+  bsetsize(sb.bsize);
   initlog(dev, &sb);
+  // Recovering the log may have changed the free counts.
+  readsb(dev, sb.bsize, &sb);
 }
 
 // Zero a block.
-static void bzero(int dev, int bno) {
+static void bzero(int dev, int bno, int data) {
   struct buf *bp;
 
   bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  memset(bp->data, 0, sb.bsize);
+  if (data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint balloc(uint dev) {
+// Add db to the super block's count of free blocks and di to
+// its count of free inodes, on disk as part of the current
+// transaction and in sb.
+static void sbcount(int dev, int db, int di) {
+  struct buf *bp;
+  struct superblock *dsb;
+
+  bp = bread(dev, SBOFF / sb.bsize);
+  dsb = (struct superblock *)(bp->data + SBOFF % sb.bsize);
+  dsb->nfree += db;
+  dsb->nifree += di;
+  sb.nfree = dsb->nfree;
+  sb.nifree = dsb->nifree;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Allocate a zeroed disk block, for file data if data. Blocks
+// freed by the running transaction aren't used for data; see
+// log_free().
+// Returns 0 if the disk is full.
+static uint balloc(uint dev, int data) {
   int b, bi, m;
   struct buf *bp;
 
+  if (sb.nfree == 0) return 0;
   bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
+  for (b = 0; b < sb.size; b += BPB(sb.bsize)) {
     bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
+    for (bi = 0; bi < BPB(sb.bsize) && b + bi < sb.size; bi++) {
       m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) {  // Is block free?
+      if ((bp->data[bi / 8] & m) == 0 && !(data && log_freed(b + bi))) {  // Is block free?
         bp->data[bi / 8] |= m;            // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        sbcount(dev, -1, 0);
+        bzero(dev, b + bi, data);
         return b + bi;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;  // lost a race for the last block
 }
 
 // Free a disk block.
@@ -83,12 +115,14 @@ static void bfree(int dev, uint b) {
   int bi, m;
 
   bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
+  bi = b % BPB(sb.bsize);
   m = 1 << (bi % 8);
   if ((bp->data[bi / 8] & m) == 0) panic("freeing free block");
   bp->data[bi / 8] &= ~m;
   log_write(bp);
   brelse(bp);
+  sbcount(dev, 1, 0);
+  log_free(b);
 }
 
 // Inodes.
@@ -117,7 +151,7 @@ static void bfree(int dev, uint b) {
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   may be recycled if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
@@ -151,26 +185,144 @@ static void bfree(int dev, uint b) {
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cache is a hash table keyed on (dev, inum). Each bucket's
+// spin-lock protects the bucket's chain and the ip->ref of the
+// entries on it, so lookups of different inodes do not contend.
+// Unreferenced entries (ip->ref == 0) stay hashed and valid on an
+// LRU list, protected by icache.lrulock, so that a later iget() of
+// the same inode needs no disk read; they are only recycled when
+// an entry is needed for a different inode. icache.lock serializes
+// recycling and growing the cache, which is the only way ip->dev
+// and ip->inum change. Lock order: icache.lock, bucket lock,
+// icache.lrulock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 31
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
+
 struct {
   struct spinlock lock;
+  struct spinlock lrulock;
+  struct ibucket bucket[NIBUCKET];
+
+  // List of unreferenced cached inodes, through lruprev/lrunext.
+  // lru.lrunext is most recently released, lru.lruprev is least.
+  struct inode lru;
+
+  struct inode *free;  // never-used entries, through next
+  int n;               // number of entries, including pages from igrow()
   struct inode inode[NINODE];
 } icache;
 
+static void dcacheinit(void);
+static void dcache_purge(uint dev, uint dir);
+
 void iinit() {
   int i = 0;
 
   initlock(&icache.lock, "icache");
+  initlock(&icache.lrulock, "icache.lru");
+  for (i = 0; i < NIBUCKET; i++) {
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+  }
+  icache.lru.lruprev = &icache.lru;
+  icache.lru.lrunext = &icache.lru;
   for (i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    icache.inode[i].next = icache.free;
+    icache.free = &icache.inode[i];
+  }
+  icache.n = NINODE;
+  dcacheinit();
+}
+
+static struct ibucket *ibucket(uint dev, uint inum) { return &icache.bucket[IHASH(dev, inum)]; }
+
+// Put an unreferenced inode on the LRU list. Inodes whose
+// content is no longer valid go to the cold end, to be
+// recycled first. Caller must hold ip's bucket lock.
+static void lru_insert(struct inode *ip) {
+  struct inode *at;
+
+  acquire(&icache.lrulock);
+  at = ip->valid ? &icache.lru : icache.lru.lruprev;
+  ip->lrunext = at->lrunext;
+  ip->lruprev = at;
+  at->lrunext->lruprev = ip;
+  at->lrunext = ip;
+  release(&icache.lrulock);
+}
+
+// Take an inode off the LRU list.
+// Caller must hold ip's bucket lock.
+static void lru_remove(struct inode *ip) {
+  acquire(&icache.lrulock);
+  ip->lrunext->lruprev = ip->lruprev;
+  ip->lruprev->lrunext = ip->lrunext;
+  ip->lrunext = ip->lruprev = 0;
+  release(&icache.lrulock);
+}
+
+// Add a page worth of entries to the free list,
+// once every cached inode is referenced.
+// Caller must hold icache.lock.
+static int igrow(void) {
+  struct inode *ip, *end;
+
+  if (icache.n >= NINODEMAX || (ip = (struct inode *)kalloc()) == 0) return 0;
+  memset(ip, 0, PGSIZE);
+  for (end = ip + PGSIZE / sizeof(*ip); ip < end; ip++) {
+    initsleeplock(&ip->lock, "inode");
+    ip->next = icache.free;
+    icache.free = ip;
+    icache.n++;
+  }
+  return 1;
+}
+
+// Find an entry that can hold a different inode: a never-used
+// one, else the least recently used unreferenced one, else
+// grow the cache. The entry is unhashed on return.
+// Caller must hold icache.lock.
+static struct inode *irecycle(void) {
+  struct inode *ip, **pp;
+  struct ibucket *b;
+
+  for (;;) {
+    if ((ip = icache.free) != 0) {
+      icache.free = ip->next;
+      return ip;
+    }
+
+    acquire(&icache.lrulock);
+    ip = icache.lru.lruprev;
+    release(&icache.lrulock);
+    if (ip == &icache.lru) {
+      if (igrow()) continue;
+      return 0;
+    }
+
+    // ip->dev and ip->inum can't change since we hold icache.lock,
+    // but an iget() may revive ip before we lock its bucket.
+    b = ibucket(ip->dev, ip->inum);
+    acquire(&b->lock);
+    if (ip->ref == 0) {
+      lru_remove(ip);
+      for (pp = &b->head; *pp != ip; pp = &(*pp)->next)
+        ;
+      *pp = ip->next;
+      release(&b->lock);
+      return ip;
+    }
+    release(&b->lock);
   }
 }
 
@@ -178,25 +330,30 @@ static struct inode *iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Regular files start out with their data inline.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there are no free inodes.
 struct inode *ialloc(uint dev, short type) {
   int inum;
   struct buf *bp;
   struct dinode *dip;
 
+  if (sb.nifree == 0) return 0;
   for (inum = 1; inum < sb.ninodes; inum++) {
     bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode *)bp->data + inum % IPB;
+    dip = (struct dinode *)bp->data + inum % IPB(sb.bsize);
     if (dip->type == 0) {  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if (type == T_FILE) dip->flags = DI_INLINE;
       log_write(bp);  // mark it allocated on the disk
       brelse(bp);
+      sbcount(dev, 0, -1);
       return iget(dev, inum);
     }
     brelse(bp);
   }
-  panic("ialloc: no inodes");
+  return 0;
 }
 
 // Copy a modified in-memory inode to disk.
@@ -208,45 +365,66 @@ void iupdate(struct inode *ip) {
   struct dinode *dip;
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-  dip = (struct dinode *)bp->data + ip->inum % IPB;
+  dip = (struct dinode *)bp->data + ip->inum % IPB(sb.bsize);
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->flags = ip->flags;
+  memmove(dip->idata, ip->idata, sizeof(ip->idata));
   log_write(bp);
   brelse(bp);
 }
 
+// Look for inode inum on device dev in bucket b and take
+// a reference to it. Caller must hold b->lock.
+static struct inode *ilookup(struct ibucket *b, uint dev, uint inum) {
+  struct inode *ip;
+
+  for (ip = b->head; ip != 0; ip = ip->next) {
+    if (ip->dev == dev && ip->inum == inum) {
+      if (ip->ref == 0) lru_remove(ip);
+      ip->ref++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct ibucket *b = ibucket(dev, inum);
+  struct inode *ip;
 
   // Is the inode already cached?
-  empty = 0;
-  for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
-    }
-    if (empty == 0 && ip->ref == 0)  // Remember empty slot.
-      empty = ip;
-  }
+  acquire(&b->lock);
+  ip = ilookup(b, dev, inum);
+  release(&b->lock);
+  if (ip) return ip;
 
-  // Recycle an inode cache entry.
-  if (empty == 0) panic("iget: no inodes");
+  // Recycle an inode cache entry. Another process may have
+  // cached the inode before we got icache.lock, so look again.
+  acquire(&icache.lock);
+  acquire(&b->lock);
+  ip = ilookup(b, dev, inum);
+  release(&b->lock);
+  if (ip) {
+    release(&icache.lock);
+    return ip;
+  }
 
-  ip = empty;
+  if ((ip = irecycle()) == 0) panic("iget: no inodes");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  acquire(&b->lock);
+  ip->next = b->head;
+  b->head = ip;
+  release(&b->lock);
   release(&icache.lock);
 
   return ip;
@@ -255,9 +433,11 @@ static struct inode *iget(uint dev, uint inum) {
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
-  acquire(&icache.lock);
+  struct ibucket *b = ibucket(ip->dev, ip->inum);
+
+  acquire(&b->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&b->lock);
   return ip;
 }
 
@@ -273,13 +453,14 @@ void ilock(struct inode *ip) {
 
   if (ip->valid == 0) {
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode *)bp->data + ip->inum % IPB;
+    dip = (struct dinode *)bp->data + ip->inum % IPB(sb.bsize);
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->flags = dip->flags;
+    memmove(ip->idata, dip->idata, sizeof(ip->idata));
     brelse(bp);
     ip->valid = 1;
     if (ip->type == 0) panic("ilock: no type");
@@ -294,14 +475,16 @@ void iunlock(struct inode *ip) {
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry moves
+// to the LRU list and can be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
 // case it has to free the inode.
 void iput(struct inode *ip) {
-  acquire(&icache.lock);
+  struct ibucket *b = ibucket(ip->dev, ip->inum);
+
+  acquire(&b->lock);
 
   if (ip->ref == 1 && ip->valid && ip->nlink == 0) {
     // inode has no links and no other references: truncate and free.
@@ -310,20 +493,23 @@ void iput(struct inode *ip) {
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&b->lock);
 
+    if (ip->type == T_DIR) dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    sbcount(ip->dev, 0, 1);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&b->lock);
   }
 
   ip->ref--;
-  release(&icache.lock);
+  if (ip->ref == 0) lru_insert(ip);
+  release(&b->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -338,26 +524,38 @@ void iunlockput(struct inode *ip) {
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// A small regular file instead keeps its data in the inode
+// itself, in ip->idata[] over ip->addrs[], and is marked
+// DI_INLINE. Reading it needs only the inode block. It moves to
+// block storage when it grows past NINLINE bytes, and becomes
+// inline again when truncated.
+
+// Is ip's data written in place rather than logged?
+static int ordered(struct inode *ip) { return (sb.flags & SB_ORDERED) && ip->type == T_FILE; }
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, returning 0
+// if the disk is full.
 static uint bmap(struct inode *ip, uint bn) {
   uint addr, *a;
   struct buf *bp;
 
+  if (ip->flags & DI_INLINE) panic("bmap: inline");
+
   if (bn < NDIRECT) {
-    if ((addr = ip->addrs[bn]) == 0) ip->addrs[bn] = addr = balloc(ip->dev);
+    if ((addr = ip->addrs[bn]) == 0) ip->addrs[bn] = addr = balloc(ip->dev, ordered(ip));
     return addr;
   }
   bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
+  if (bn < NINDIRECT(sb.bsize)) {
     // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0) ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    if ((addr = ip->addrs[NDIRECT]) == 0 && (ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0)) == 0) return 0;
     bp = bread(ip->dev, addr);
     a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      a[bn] = addr = balloc(ip->dev);
+    if ((addr = a[bn]) == 0 && (addr = balloc(ip->dev, ordered(ip))) != 0) {
+      a[bn] = addr;
       log_write(bp);
     }
     brelse(bp);
@@ -374,6 +572,8 @@ void itrunc(struct inode *ip) {
   struct buf *bp;
   uint *a;
 
+  if (ip->flags & DI_INLINE) goto done;
+
   for (i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i]) {
       bfree(ip->dev, ip->addrs[i]);
@@ -384,7 +584,7 @@ void itrunc(struct inode *ip) {
   if (ip->addrs[NDIRECT]) {
     bp = bread(ip->dev, ip->addrs[NDIRECT]);
     a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
+    for (j = 0; j < NINDIRECT(sb.bsize); j++) {
       if (a[j]) bfree(ip->dev, a[j]);
     }
     brelse(bp);
@@ -392,10 +592,22 @@ void itrunc(struct inode *ip) {
     ip->addrs[NDIRECT] = 0;
   }
 
+done:
+  memset(ip->idata, 0, sizeof(ip->idata));
+  if (ip->type == T_FILE) ip->flags |= DI_INLINE;
   ip->size = 0;
   iupdate(ip);
 }
 
+// Report the file system's size and free space.
+void fsstat(struct statfs *st) {
+  st->bsize = sb.bsize;
+  st->blocks = sb.nblocks;
+  st->bfree = sb.nfree;
+  st->files = sb.ninodes - 1;  // inode 0 is never used
+  st->ffree = sb.nifree;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void stati(struct inode *ip, struct stat *st) {
@@ -404,6 +616,7 @@ void stati(struct inode *ip, struct stat *st) {
   st->type = ip->type;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  st->blksize = sb.bsize;
 }
 
 // Read data from inode.
@@ -417,10 +630,12 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
   if (off > ip->size || off + n < off) return 0;
   if (off + n > ip->size) n = ip->size - off;
 
+  if (ip->flags & DI_INLINE) return either_copyout(user_dst, dst, ip->idata + off, n) == -1 ? 0 : n;
+
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-    bp = bread(ip->dev, bmap(ip, off / BSIZE));
-    m = min(n - tot, BSIZE - off % BSIZE);
-    if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    bp = bread(ip->dev, bmap(ip, off / sb.bsize));
+    m = min(n - tot, sb.bsize - off % sb.bsize);
+    if (either_copyout(user_dst, dst, bp->data + (off % sb.bsize), m) == -1) {
       brelse(bp);
       break;
     }
@@ -429,25 +644,95 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
   return tot;
 }
 
+// Pass up to n bytes of ip starting at off to fn, a piece at
+// a time, straight out of the buffer cache instead of copying
+// them to a caller's buffer first. fn returns how many bytes it
+// consumed, or -1; stop early when it consumes less than it was
+// given. Returns the number of bytes consumed, or -1 if none
+// were and fn failed. Caller must hold ip->lock.
+int sendi(struct inode *ip, uint off, uint n, int (*fn)(void *, char *, int), void *arg) {
+  uint tot, m;
+  int r;
+  struct buf *bp;
+
+  if (off > ip->size || off + n < off) return 0;
+  if (off + n > ip->size) n = ip->size - off;
+
+  if (ip->flags & DI_INLINE) return n > 0 ? fn(arg, ip->idata + off, n) : 0;
+
+  for (tot = 0; tot < n; tot += r, off += r) {
+    bp = bread(ip->dev, bmap(ip, off / sb.bsize));
+    m = min(n - tot, sb.bsize - off % sb.bsize);
+    r = fn(arg, (char *)bp->data + (off % sb.bsize), m);
+    brelse(bp);
+    if (r < 0) return tot > 0 ? tot : -1;
+    if (r != m) {
+      tot += r;
+      break;
+    }
+  }
+  return tot;
+}
+
+// Move the inline data of ip to a block of its own.
+// Returns 0, or -1 if the disk is full.
+// Caller must hold ip->lock.
+static int iunline(struct inode *ip) {
+  struct buf *bp;
+  uint addr = 0;
+
+  if (ip->size > 0) {
+    if ((addr = balloc(ip->dev, ordered(ip))) == 0) return -1;
+    bp = bread(ip->dev, addr);
+    memmove(bp->data, ip->idata, ip->size);
+    if (ordered(ip))
+      log_data(bp);
+    else
+      log_write(bp);
+    brelse(bp);
+  }
+  memset(ip->idata, 0, sizeof(ip->idata));
+  ip->addrs[0] = addr;
+  ip->flags &= ~DI_INLINE;
+  return 0;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
+// Returns the number of bytes written, which is less than n
+// if the disk fills up or src is bad.
 int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if (off > ip->size || off + n < off) return -1;
-  if (off + n > MAXFILE * BSIZE) return -1;
+  if (off + n > MAXFILE(sb.bsize) * sb.bsize) return -1;
+
+  if (ip->flags & DI_INLINE) {
+    if (off + n > NINLINE) {
+      if (iunline(ip) < 0) return -1;
+    } else {
+      if (either_copyin(ip->idata + off, user_src, src, n) == -1) return -1;
+      if (off + n > ip->size) ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+  }
 
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
-    bp = bread(ip->dev, bmap(ip, off / BSIZE));
-    m = min(n - tot, BSIZE - off % BSIZE);
-    if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    if ((addr = bmap(ip, off / sb.bsize)) == 0) break;
+    bp = bread(ip->dev, addr);
+    m = min(n - tot, sb.bsize - off % sb.bsize);
+    if (either_copyin(bp->data + (off % sb.bsize), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if (ordered(ip))
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -459,40 +744,469 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
+// Directory entry cache.
+//
+// The dcache remembers the outcome of recent dirlookup()s:
+// (dev, directory inum, name) maps to the entry's inum and byte
+// offset, or to inum 0 if the directory has no such name, so
+// repeated lookups of the same path skip the directory scan.
+// Entries are only filled or changed while the directory's
+// ip->lock is held, by dirlookup(), dirlink() and dirunlink(),
+// so a cached entry always agrees with the directory on disk.
+// Each bucket is a small LRU set protected by its own spin-lock.
+// Names longer than DNAMELEN are rare and are not cached.
+
+#define NDBUCKET 61
+#define NDWAY 4
+#define DNAMELEN 27
+
+struct dentry {
+  uint dev;
+  uint dir;   // directory inum; 0 if this slot is unused
+  uint inum;  // inum the name refers to; 0 if not present
+  uint off;   // byte offset of the dirent in the directory
+  uint used;  // bucket clock at last use, for LRU replacement
+  char name[DNAMELEN + 1];
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dentry ent[NDWAY];
+} dcache[NDBUCKET];
+
+static void dcacheinit(void) {
+  for (int i = 0; i < NDBUCKET; i++) initlock(&dcache[i].lock, "dcache");
+}
+
+static int dhash(uint dev, uint dir, char *name) {
+  uint h = dev * 31 + dir;
+
+  for (int i = 0; name[i]; i++) h = h * 31 + (uchar)name[i];
+  return h % NDBUCKET;
+}
+
+// Find name in directory dir of bucket b.
+// Caller must hold b's lock.
+static struct dentry *dfind(int b, uint dev, uint dir, char *name) {
+  struct dentry *d;
+
+  for (d = dcache[b].ent; d < dcache[b].ent + NDWAY; d++) {
+    if (d->dir == dir && d->dev == dev && strncmp(d->name, name, DNAMELEN + 1) == 0) {
+      d->used = ++dcache[b].clock;
+      return d;
+    }
+  }
+  return 0;
+}
+
+// Look up name in directory dp.
+// Returns 1 and sets *pinum and *poff if the outcome is cached.
+// Caller must hold dp->lock.
+static int dcache_lookup(struct inode *dp, char *name, uint *pinum, uint *poff) {
+  struct dentry *d;
+  int b;
+
+  if (strlen(name) > DNAMELEN) return 0;
+  b = dhash(dp->dev, dp->inum, name);
+  acquire(&dcache[b].lock);
+  if ((d = dfind(b, dp->dev, dp->inum, name)) != 0) {
+    *pinum = d->inum;
+    *poff = d->off;
+  }
+  release(&dcache[b].lock);
+  return d != 0;
+}
+
+// Record that name in directory dp refers to inum at offset off,
+// or that it is not present if inum is 0.
+// Caller must hold dp->lock.
+static void dcache_enter(struct inode *dp, char *name, uint inum, uint off) {
+  struct dentry *d, *victim;
+  int b;
+
+  if (strlen(name) > DNAMELEN) return;
+  b = dhash(dp->dev, dp->inum, name);
+  acquire(&dcache[b].lock);
+  if ((d = dfind(b, dp->dev, dp->inum, name)) == 0) {
+    // Recycle an unused or the least recently used slot.
+    victim = dcache[b].ent;
+    for (d = dcache[b].ent; d < dcache[b].ent + NDWAY; d++) {
+      if (d->dir == 0) {
+        victim = d;
+        break;
+      }
+      if (d->used < victim->used) victim = d;
+    }
+    d = victim;
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    safestrcpy(d->name, name, sizeof(d->name));
+    d->used = ++dcache[b].clock;
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache[b].lock);
+}
+
+// Forget every entry of directory dir, because its entries
+// have moved, or it is being freed and its inum may be reused.
+static void dcache_purge(uint dev, uint dir) {
+  struct dentry *d;
+
+  for (int b = 0; b < NDBUCKET; b++) {
+    acquire(&dcache[b].lock);
+    for (d = dcache[b].ent; d < dcache[b].ent + NDWAY; d++) {
+      if (d->dir == dir && d->dev == dev) d->dir = 0;
+    }
+    release(&dcache[b].lock);
+  }
+}
+
+// Directory blocks.
+
+#define DIRENT(data, off) ((struct dirent *)((data) + (off)))
+
+// Return the record at offset off of directory block data,
+// checking that it stays within the block.
+static struct dirent *blkrec(uchar *data, int off) {
+  struct dirent *de = DIRENT(data, off);
+
+  if (de->reclen < sizeof(*de) || off + de->reclen > sb.bsize) panic("bad dirent");
+  return de;
+}
+
+// Make directory block data a single unused record.
+static void blkinit(uchar *data) {
+  memset(data, 0, sb.bsize);
+  DIRENT(data, 0)->reclen = sb.bsize;
+}
+
+// Return the offset in directory block data of the record
+// for the len-byte name, or -1 if there is none.
+static int blkfind(uchar *data, char *name, int len) {
+  struct dirent *de;
+  int off;
+
+  for (off = 0; off < sb.bsize; off += de->reclen) {
+    de = blkrec(data, off);
+    if (de->inum != 0 && de->namelen == len && memcmp(de->name, name, len) == 0) return off;
+  }
+  return -1;
+}
+
+// Find room for a record holding a len-byte name in directory
+// block data, splitting it off the free space at the end of a
+// record if necessary. Returns the unused record's offset, or -1.
+static int blkalloc(uchar *data, int len) {
+  struct dirent *de, *ne;
+  int off, used;
+
+  for (off = 0; off < sb.bsize; off += de->reclen) {
+    de = blkrec(data, off);
+    used = de->inum ? DIRREC(de->namelen) : 0;
+    if (de->reclen - used < DIRREC(len)) continue;
+    if (used == 0) return off;
+    ne = DIRENT(data, off + used);
+    ne->inum = 0;
+    ne->reclen = de->reclen - used;
+    de->reclen = used;
+    return off + used;
+  }
+  return -1;
+}
+
+// Fill the unused record at offset off of directory block data.
+static void blkset(uchar *data, int off, char *name, int len, uint inum) {
+  struct dirent *de = DIRENT(data, off);
+
+  de->inum = inum;
+  de->namelen = len;
+  de->pad = 0;
+  memmove(de->name, name, len);
+}
+
+// Remove the record at offset off of directory block data,
+// giving its space to the previous record.
+static void blkremove(uchar *data, int off) {
+  struct dirent *de, *prev = 0;
+  int o;
+
+  for (o = 0; o < off; o += de->reclen) prev = de = blkrec(data, o);
+  if (o != off) panic("blkremove");
+  if (prev)
+    prev->reclen += DIRENT(data, off)->reclen;
+  else
+    DIRENT(data, off)->inum = 0;
+}
+
+// Look for the len-byte name in block bn of directory dp.
+// Returns the record's byte offset in dp and sets *pinum,
+// or returns -1 if name is not there.
+static int dirscan(struct inode *dp, uint bn, char *name, int len, uint *pinum) {
+  struct buf *bp;
+  int off;
+
+  bp = bread(dp->dev, bmap(dp, bn));
+  if ((off = blkfind(bp->data, name, len)) >= 0) {
+    *pinum = DIRENT(bp->data, off)->inum;
+    off += bn * sb.bsize;
+  }
+  brelse(bp);
+  return off;
+}
+
+// Add (name, inum) to block bn of directory dp if it has room.
+// Returns the record's byte offset in dp, or -1.
+static int dirinsert(struct inode *dp, uint bn, char *name, int len, uint inum) {
+  struct buf *bp;
+  int off;
+
+  bp = bread(dp->dev, bmap(dp, bn));
+  if ((off = blkalloc(bp->data, len)) >= 0) {
+    blkset(bp->data, off, name, len, inum);
+    log_write(bp);
+    off += bn * sb.bsize;
+  }
+  brelse(bp);
+  return off;
+}
+
+// Append an empty block to directory dp.
+// Returns its block number, or -1 if dp is as big as a file can
+// be or the disk is full.
+static int dirgrow(struct inode *dp) {
+  struct buf *bp;
+  uint addr, bn = dp->size / sb.bsize;
+
+  if (bn >= MAXFILE(sb.bsize) || (addr = bmap(dp, bn)) == 0) return -1;
+  bp = bread(dp->dev, addr);
+  blkinit(bp->data);
+  log_write(bp);
+  brelse(bp);
+  dp->size = (bn + 1) * sb.bsize;
+  iupdate(dp);
+  return bn;
+}
+
+#define DXHDR(bp) ((struct dxhdr *)((bp)->data + DXOFF))
+#define DXENT(bp) ((struct dxentry *)(DXHDR(bp) + 1))
+
+// If dp is an indexed directory, return its locked block 0.
+// Otherwise return 0.
+static struct buf *dxroot(struct inode *dp) {
+  struct buf *bp;
+
+  if (dp->size <= sb.bsize) return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  if (DIRENT(bp->data, 0)->reclen == DIRREC(1) && DIRENT(bp->data, DIRREC(1))->reclen == sb.bsize - DIRREC(1) &&
+      DXHDR(bp)->magic == DXMAGIC)
+    return bp;
+  brelse(bp);
+  return 0;
+}
+
+// Return the index of the dxentry in root block bp
+// whose leaf holds names with hash h.
+static int dxsearch(struct buf *bp, uint h) {
+  struct dxentry *e = DXENT(bp);
+  int lo = 0, hi = DXHDR(bp)->count - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Choose the hash at which to split a leaf holding names with
+// the n hashes hv[], near the middle but never between equal
+// hashes, since a hash must map to exactly one leaf.
+// Returns 0 if all hashes are equal.
+static int dxsplitpoint(uint *hv, int n, uint *ph) {
+  uint t;
+  int i, j, d;
+
+  for (i = 1; i < n; i++) {
+    t = hv[i];
+    for (j = i; j > 0 && hv[j - 1] > t; j--) hv[j] = hv[j - 1];
+    hv[j] = t;
+  }
+  for (d = 0; d < n; d++) {
+    if (n / 2 + d < n && n / 2 + d > 0 && hv[n / 2 + d - 1] != hv[n / 2 + d]) {
+      *ph = hv[n / 2 + d];
+      return 1;
+    }
+    if (n / 2 - d > 0 && hv[n / 2 - d - 1] != hv[n / 2 - d]) {
+      *ph = hv[n / 2 - d];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Split the full leaf of dxentry i of indexed directory dp,
+// moving the names whose hash is above the split point to a
+// new leaf. Returns -1 if the index, the directory or the disk
+// is full.
+static int dxsplit(struct inode *dp, int i) {
+  struct buf *root, *bp, *np;
+  struct dirent *de;
+  struct dxentry *e;
+  uint nb, h, addr, *hv;
+  int n, off, next;
+
+  nb = dp->size / sb.bsize;
+  root = dxroot(dp);
+  e = DXENT(root);
+  if (DXHDR(root)->count >= DXLIMIT(sb.bsize) || nb >= MAXFILE(sb.bsize) || (hv = (uint *)kalloc()) == 0) {
+    brelse(root);
+    return -1;
+  }
+
+  bp = bread(dp->dev, bmap(dp, e[i].block));
+  n = 0;
+  for (off = 0; off < sb.bsize; off += de->reclen) {
+    de = blkrec(bp->data, off);
+    if (de->inum != 0) hv[n++] = dxhash(de->name, de->namelen);
+  }
+  n = dxsplitpoint(hv, n, &h);
+  kfree(hv);
+  if (n == 0) {
+    brelse(bp);
+    brelse(root);
+    return -1;
+  }
+
+  if ((addr = bmap(dp, nb)) == 0) {
+    brelse(bp);
+    brelse(root);
+    return -1;
+  }
+  np = bread(dp->dev, addr);
+  blkinit(np->data);
+  for (off = 0; off < sb.bsize; off = next) {
+    de = blkrec(bp->data, off);
+    next = off + de->reclen;
+    if (de->inum == 0 || dxhash(de->name, de->namelen) < h) continue;
+    blkset(np->data, blkalloc(np->data, de->namelen), de->name, de->namelen, de->inum);
+    blkremove(bp->data, off);
+  }
+  log_write(np);
+  log_write(bp);
+  brelse(np);
+  brelse(bp);
+
+  memmove(e + i + 2, e + i + 1, (DXHDR(root)->count - i - 1) * sizeof(*e));
+  e[i + 1].hash = h;
+  e[i + 1].block = nb;
+  DXHDR(root)->count++;
+  log_write(root);
+  brelse(root);
+
+  dp->size = (nb + 1) * sb.bsize;
+  iupdate(dp);
+  // Cached offsets of the moved entries are stale.
+  dcache_purge(dp->dev, dp->inum);
+  return 0;
+}
+
+// Turn the full one-block linear directory dp into an indexed
+// one, whose single leaf holds all entries but "." and "..".
+// Returns 0, or -1 if the disk is full.
+static int dxconvert(struct inode *dp) {
+  struct buf *root, *bp;
+  struct dirent *de;
+  struct dxentry *e;
+  uint addr;
+  int off, k;
+
+  if ((addr = bmap(dp, 1)) == 0) return -1;
+  root = bread(dp->dev, bmap(dp, 0));
+  bp = bread(dp->dev, addr);
+  blkinit(bp->data);
+  for (off = 0, k = 0; off < sb.bsize; off += de->reclen, k++) {
+    de = blkrec(root->data, off);
+    if (k >= 2 && de->inum != 0)
+      blkset(bp->data, blkalloc(bp->data, de->namelen), de->name, de->namelen, de->inum);
+  }
+
+  DIRENT(root->data, DIRREC(1))->reclen = sb.bsize - DIRREC(1);
+  memset(root->data + DXOFF, 0, sb.bsize - DXOFF);
+  DXHDR(root)->magic = DXMAGIC;
+  DXHDR(root)->count = 1;
+  e = DXENT(root);
+  e[0].hash = 0;
+  e[0].block = 1;
+  log_write(bp);
+  log_write(root);
+  brelse(bp);
+  brelse(root);
+
+  dp->size = 2 * sb.bsize;
+  iupdate(dp);
+  dcache_purge(dp->dev, dp->inum);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+  uint bn, inum, coff;
+  struct buf *root;
+  int off, len;
 
   if (dp->type != T_DIR) panic("dirlookup not DIR");
 
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) panic("dirlookup read");
-    if (de.inum == 0) continue;
-    if (namecmp(name, de.name) == 0) {
-      // entry matches path element
-      if (poff) *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if (dcache_lookup(dp, name, &inum, &coff)) {
+    if (inum == 0) return 0;
+    if (poff) *poff = coff;
+    return iget(dp->dev, inum);
   }
 
-  return 0;
+  len = strlen(name);
+  off = -1;
+  if ((root = dxroot(dp)) != 0) {
+    // "." and ".." stay in block 0; the rest are in the hashed leaf.
+    bn = DXENT(root)[dxsearch(root, dxhash(name, len))].block;
+    brelse(root);
+    if ((off = dirscan(dp, 0, name, len, &inum)) < 0) off = dirscan(dp, bn, name, len, &inum);
+  } else {
+    for (bn = 0; off < 0 && bn * sb.bsize < dp->size; bn++) off = dirscan(dp, bn, name, len, &inum);
+  }
+
+  if (off < 0) {
+    dcache_enter(dp, name, 0, 0);
+    return 0;
+  }
+  // entry matches path element
+  if (poff) *poff = off;
+  dcache_enter(dp, name, inum, off);
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is present or too long, or dp is full.
+// Caller must hold dp->lock.
 int dirlink(struct inode *dp, char *name, uint inum) {
-  int off;
-  struct dirent de;
+  int off, len, i;
+  uint bn;
   struct inode *ip;
+  struct buf *root;
+
+  len = strlen(name);
+  if (len == 0 || len > DIRSIZ) return -1;
 
   // Check that name is not present.
   if ((ip = dirlookup(dp, name, 0)) != 0) {
@@ -500,19 +1214,75 @@ int dirlink(struct inode *dp, char *name, uint inum) {
     return -1;
   }
 
-  // Look for an empty dirent.
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink read");
-    if (de.inum == 0) break;
+  if ((root = dxroot(dp)) == 0) {
+    // Look for room in a block.
+    off = -1;
+    for (bn = 0; off < 0 && bn * sb.bsize < dp->size; bn++) off = dirinsert(dp, bn, name, len, inum);
+    if (off < 0) {
+      // A directory outgrowing its first block becomes indexed.
+      if (dp->size == sb.bsize) {
+        if (dxconvert(dp) < 0) return -1;
+        root = dxroot(dp);
+      } else {
+        if ((i = dirgrow(dp)) < 0) return -1;
+        off = dirinsert(dp, i, name, len, inum);
+      }
+    }
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink");
+  // Find room in the leaf for name's hash, splitting it if full.
+  while (root) {
+    i = dxsearch(root, dxhash(name, len));
+    bn = DXENT(root)[i].block;
+    brelse(root);
+    root = 0;
+    if ((off = dirinsert(dp, bn, name, len, inum)) < 0) {
+      if (dxsplit(dp, i) < 0) return -1;
+      root = dxroot(dp);
+    }
+  }
+
+  dcache_enter(dp, name, inum, off);
 
   return 0;
 }
 
+// Remove the entry for name, which dirlookup() found at
+// byte offset off, from the directory dp.
+// Caller must hold dp->lock.
+void dirunlink(struct inode *dp, char *name, uint off) {
+  struct buf *bp;
+
+  bp = bread(dp->dev, bmap(dp, off / sb.bsize));
+  blkremove(bp->data, off % sb.bsize);
+  log_write(bp);
+  brelse(bp);
+  dcache_enter(dp, name, 0, 0);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+// Caller must hold dp->lock.
+int isdirempty(struct inode *dp) {
+  struct buf *bp;
+  struct dirent *de;
+  uint bn;
+  int off, empty = 1;
+
+  for (bn = 0; empty && bn * sb.bsize < dp->size; bn++) {
+    bp = bread(dp->dev, bmap(dp, bn));
+    for (off = 0; off < sb.bsize; off += de->reclen) {
+      de = blkrec(bp->data, off);
+      if (de->inum == 0) continue;
+      if ((de->namelen == 1 && de->name[0] == '.') || (de->namelen == 2 && de->name[0] == '.' && de->name[1] == '.'))
+        continue;
+      empty = 0;
+      break;
+    }
+    brelse(bp);
+  }
+  return empty;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -520,12 +1290,14 @@ int dirlink(struct inode *dp, char *name, uint inum) {
 // The returned path has no leading slashes,
 // so the caller can check *path=='\0' to see if the name is the last one.
 // If no name to remove, return 0.
+// A name longer than DIRSIZ is returned as "", which names nothing.
 //
 // Examples:
 //   skipelem("a/bb/c", name) = "bb/c", setting name = "a"
 //   skipelem("///a//bb", name) = "bb", setting name = "a"
 //   skipelem("a", name) = "", setting name = "a"
 //   skipelem("", name) = skipelem("////", name) = 0
+//   skipelem("<256 x's>/b", name) = "b", setting name = ""
 //
 static char *skipelem(char *path, char *name) {
   char *s;
@@ -536,31 +1308,34 @@ static char *skipelem(char *path, char *name) {
   s = path;
   while (*path != '/' && *path != 0) path++;
   len = path - s;
-  if (len >= DIRSIZ)
-    memmove(name, s, DIRSIZ);
-  else {
-    memmove(name, s, len);
-    name[len] = 0;
-  }
+  if (len > DIRSIZ) len = 0;
+  memmove(name, s, len);
+  name[len] = 0;
   while (*path == '/') path++;
   return path;
 }
 
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
-// path element into name, which must have room for DIRSIZ bytes.
+// path element into name, which must have room for DIRSIZ+1 bytes.
 // Must be called inside a transaction since it calls iput().
 static struct inode *namex(char *path, int nameiparent, char *name) {
   struct inode *ip, *next;
+  struct files *fs;
 
-  if (*path == '/')
+  if (*path == '/') {
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  } else {
+    // Another thread may chdir() meanwhile.
+    fs = myproc()->files;
+    acquire(&fs->lock);
+    ip = idup(fs->cwd);
+    release(&fs->lock);
+  }
 
   while ((path = skipelem(path, name)) != 0) {
     ilock(ip);
-    if (ip->type != T_DIR) {
+    if (ip->type != T_DIR || *name == 0) {
       iunlockput(ip);
       return 0;
     }
@@ -584,7 +1359,7 @@ static struct inode *namex(char *path, int nameiparent, char *name) {
 }
 
 struct inode *namei(char *path) {
-  char name[DIRSIZ];
+  char name[DIRSIZ + 1];
   return namex(path, 0, name);
 }
 
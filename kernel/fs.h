@@ -3,14 +3,18 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#define BSIZE 4096  // largest block size, and the size of a buffer
+#define MINBSIZE 1024  // smallest block size
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
-// mkfs computes the super block and builds an initial file system. The
-// super block describes the disk layout:
+// mkfs picks a block size of 1024, 2048 or 4096 bytes, computes
+// the super block and builds an initial file system. The super
+// block is always at byte SBOFF, so that it can be found before
+// the block size is known; with blocks larger than SBOFF it shares
+// block 0 with the boot block. It describes the disk layout:
 struct superblock {
   uint magic;        // Must be FSMAGIC
   uint size;         // Size of file system image (blocks)
@@ -20,13 +24,27 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes)
+  uint flags;        // SB_* options
+  uint nfree;        // Number of free blocks
+  uint nifree;       // Number of free inodes
 };
 
+#define SB_ORDERED 0x1  // journal only metadata; see log.c
+
+#define SBOFF 1024
+
 #define FSMAGIC 0x10203040
 
 #define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NINDIRECT(bsize) ((bsize) / sizeof(uint))
+#define MAXFILE(bsize) (NDIRECT + NINDIRECT(bsize))
+
+// Bytes of file data an inode can hold in place of block addresses
+#define NINLINE 112
+
+// Inode flags
+#define DI_INLINE 0x1  // data is in the inode, not in blocks
 
 // On-disk inode structure
 struct dinode {
@@ -35,26 +53,71 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // DI_INLINE
+  union {
+    uint addrs[NDIRECT+1];   // Data block addresses
+    char idata[NINLINE];     // Inline data (DI_INLINE)
+  };
 };
 
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct dinode))
+#define IPB(bsize)    ((bsize) / sizeof(struct dinode))
 
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     ((i) / IPB(sb.bsize) + sb.inodestart)
 
 // Bitmap bits per block
-#define BPB           (BSIZE*8)
+#define BPB(bsize)    ((bsize)*8)
 
 // Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+#define BBLOCK(b, sb) ((b)/BPB(sb.bsize) + sb.bmapstart)
 
-// Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+// Directory is a file containing a sequence of variable-length
+// dirent records. Records never span blocks: the records of a
+// block cover it exactly, each reclen including any free space
+// up to the next record. An unused record has inum 0.
+#define DIRSIZ 255  // max name length
 
 struct dirent {
-  ushort inum;
-  char name[DIRSIZ];
+  uint inum;
+  ushort reclen;  // bytes from this record to the next
+  uchar namelen;
+  uchar pad;
+  char name[];    // namelen bytes, not nul-terminated
+};
+
+// Size of a record holding an n-byte name
+#define DIRREC(n)     ((sizeof(struct dirent) + (n) + 3) & ~3)
+
+// A directory that outgrows one block is indexed by name hash.
+// Block 0 holds "." and then "..", whose record spans the rest of
+// the block and hides a dxhdr and an array of dxentry from
+// programs reading the directory linearly. The other blocks are
+// leaves of ordinary records: dxentry i names the leaf holding
+// the names whose dxhash() is at least its hash and less than
+// the hash of dxentry i+1.
+struct dxhdr {
+  uint magic;     // DXMAGIC
+  uint count;     // number of dxentry in use
 };
 
+struct dxentry {
+  uint hash;      // smallest name hash stored in the leaf
+  uint block;     // leaf block number within the directory
+};
+
+#define DXMAGIC 0x78646978
+
+// Offset of the dxhdr in block 0
+#define DXOFF         (DIRREC(1) + DIRREC(2))
+
+// Max leaves of an indexed directory
+#define DXLIMIT(bsize) (((bsize) - DXOFF - sizeof(struct dxhdr)) / sizeof(struct dxentry))
+
+// Hash of an n-byte directory entry name (FNV-1a), for indexed directories.
+static inline uint dxhash(const char *name, int n) {
+  uint h = 2166136261U;
+
+  for (int i = 0; i < n; i++) h = (h ^ (uchar)name[i]) * 16777619U;
+  return h;
+}
@@ -0,0 +1,74 @@
+//
+// Futexes, for user-level locks.
+//
+// A thread waits on a word of its memory until another thread
+// wakes it, after changing the word. The word is keyed by its
+// physical address, so threads sharing the page agree on it, and
+// that address is the sleep()/wakeup() channel. A physical page
+// holding user memory holds no kernel object, so the channel
+// can't be shared with a kernel sleeper.
+//
+// futexlock makes FUTEX_WAIT's check of the word and its sleep
+// atomic with respect to FUTEX_WAKE, so a wakeup issued after the
+// word changed can't be lost.
+//
+// Processes don't share physical pages (there is no page cache,
+// and fork() copies), so a futex works between the threads of
+// one process.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "futex.h"
+
+struct spinlock futexlock;
+
+void futexinit(void) { initlock(&futexlock, "futex"); }
+
+// Return the kernel address of the int at user address addr in
+// the current process, reading its page in if needed, or 0.
+static int *futexword(uint64 addr) {
+  pagetable_t pagetable = myproc()->pagetable;
+  uint64 pa;
+  int v;
+
+  if (addr % sizeof(int) != 0 || copyin(pagetable, (char *)&v, addr, sizeof(v)) < 0) return 0;
+  if ((pa = walkaddr(pagetable, addr)) == 0) return 0;
+  return (int *)(pa + addr % PGSIZE);
+}
+
+// FUTEX_WAIT: sleep until woken if the int at addr holds val.
+// Returns 0 when woken, or -1 if it didn't hold val or the
+// process is killed. Callers must allow for spurious wakeups.
+// FUTEX_WAKE: wake at most val of the threads waiting on addr.
+// Returns the number woken.
+int futex(uint64 addr, int op, int val) {
+  struct proc *p = myproc();
+  int *w, n;
+
+  if ((w = futexword(addr)) == 0) return -1;
+  switch (op) {
+    case FUTEX_WAIT:
+      acquire(&futexlock);
+      if (*(volatile int *)w != val || p->killed) {
+        release(&futexlock);
+        return -1;
+      }
+      sleep(w, &futexlock);
+      release(&futexlock);
+      return p->killed ? -1 : 0;
+    case FUTEX_WAKE:
+      acquire(&futexlock);
+      n = wakeupn(w, val);
+      release(&futexlock);
+      return n;
+    default:
+      return -1;
+  }
+}
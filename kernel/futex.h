@@ -0,0 +1,2 @@
+#define FUTEX_WAIT 0  // sleep if the word still holds val
+#define FUTEX_WAKE 1  // wake up to val waiters
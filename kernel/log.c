@@ -20,6 +20,15 @@
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// begin_op() reserves room for MAXOPBLOCKS blocks; a call
+// that knows it needs a different amount, like a large
+// write(), uses begin_opn()/end_opn() instead.
+//
+// Apart from that, end_op() doesn't commit: a transaction
+// stays open across system calls until the logflush process
+// commits it, every COMMITTICKS ticks, or log_commit() is
+// called for fsync(), sync() or an O_SYNC file. So an
+// operation is durable only some time after it returns.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -29,9 +38,21 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// In ordered-data mode (SB_ORDERED) file data isn't logged.
+// writei() hands its blocks to log_data() instead of
+// log_write(), and commit() writes them to their home
+// locations before it writes the log, so metadata never
+// commits pointing at data that isn't on disk yet. A block
+// freed by a transaction isn't reused for file data until the
+// transaction commits (see log_free()), since the data would
+// overwrite it on disk while the committed metadata still
+// refers to it.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
+#define NFREED 512  // freed blocks remembered per transaction
+
 struct logheader {
   int n;
   int block[LOGSIZE];
@@ -42,23 +63,35 @@ struct log {
   int start;
   int size;
   int outstanding;  // how many FS sys calls are executing.
+  int reserved;     // log blocks reserved by them.
   int committing;   // in commit(), please wait.
+  int full;         // commit when the last outstanding op ends,
+  int syncwant;     // to make room, or for log_commit().
+  int ncommit;      // commits so far
   int dev;
   struct logheader lh;
+  int ndata;          // file data blocks to write before commit,
+  int data[LOGSIZE];  // in ordered-data mode
+  int nodata;         // log data too, until the next commit
+  int nfreed;         // blocks freed by this transaction, not
+  int freed[NFREED];  // to be reused for data until it commits
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logflush(void);
+static int undata(int);
 
 void initlog(int dev, struct superblock *sb) {
-  if (sizeof(struct logheader) >= BSIZE) panic("initlog: too big logheader");
+  if (sizeof(struct logheader) >= sb->bsize) panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+  kproc("logflush", logflush);
 }
 
 // Copy committed blocks from log to their home location
@@ -68,7 +101,7 @@ static void install_trans(void) {
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start + tail + 1);  // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]);    // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);                   // copy block to dst
+    memmove(dbuf->data, lbuf->data, lbuf->size);              // copy block to dst
     bwrite(dbuf);                                             // write dst to disk
     bunpin(dbuf);
     brelse(lbuf);
@@ -111,49 +144,101 @@ static void recover_from_log(void) {
 }
 
 // called at the start of each FS system call.
-void begin_op(void) {
+void begin_op(void) { begin_opn(MAXOPBLOCKS); }
+
+// called at the end of each FS system call.
+void end_op(void) { end_opn(MAXOPBLOCKS); }
+
+// Commit the open transaction. Caller holds log.lock, and no
+// operation is outstanding or committing. Releases log.lock
+// while committing.
+static void commitnow(void) {
+  log.committing = 1;
+  log.full = 0;
+  log.syncwant = 0;
+  release(&log.lock);
+
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  commit();
+
+  acquire(&log.lock);
+  log.committing = 0;
+  log.ncommit++;
+  wakeup(&log);
+}
+
+// Start an FS operation that writes at most n blocks.
+void begin_opn(int n) {
+  if (n < 1 || n > LOGSIZE) panic("begin_opn");
+
   acquire(&log.lock);
   while (1) {
-    if (log.committing) {
-      sleep(&log, &log.lock);
-    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
-      // this op might exhaust log space; wait for commit.
+    if (log.committing || log.syncwant) {
+      // let a waiting log_commit() drain the outstanding ops, or
+      // it could wait forever under steady load.
       sleep(&log, &log.lock);
+    } else if (log.lh.n + log.ndata + log.reserved + n > LOGSIZE) {
+      // this op might exhaust log space; commit first.
+      if (log.outstanding == 0) {
+        commitnow();
+      } else {
+        log.full = 1;
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
-void end_op(void) {
-  int do_commit = 0;
-
+// End an operation started by begin_opn(n).
+// commits if this was the last outstanding operation
+// and a commit is wanted now.
+void end_opn(int n) {
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= n;
   if (log.committing) panic("log.committing");
-  if (log.outstanding == 0) {
-    do_commit = 1;
-    log.committing = 1;
+  if (log.outstanding == 0 && (log.full || log.syncwant)) {
+    commitnow();
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
+    // and decrementing log.reserved has decreased
     // the amount of reserved space.
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Make every FS operation that has ended durable: commit
+// the open transaction, waiting for outstanding operations
+// to end first.
+void log_commit(void) {
+  int n;
+
+  acquire(&log.lock);
+  while (log.committing) sleep(&log, &log.lock);
+  if (log.lh.n > 0 || log.ndata > 0) {
+    if (log.outstanding == 0) {
+      commitnow();
+    } else {
+      n = log.ncommit;
+      log.syncwant = 1;
+      while (log.ncommit == n) sleep(&log, &log.lock);
+    }
+  }
+  release(&log.lock);
+}
+
+// Body of the logflush kernel process: commit now and then.
+static void logflush(void) {
+  for (;;) {
+    sleepticks(COMMITTICKS);
+    log_commit();
   }
 }
 
@@ -164,14 +249,26 @@ static void write_log(void) {
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start + tail + 1);  // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]);  // cache block
-    memmove(to->data, from->data, BSIZE);
+    memmove(to->data, from->data, from->size);
     bwrite(to);  // write the log
     brelse(from);
     brelse(to);
   }
 }
 
+// Write file data blocks to their home locations.
+static void write_data(void) {
+  for (int i = 0; i < log.ndata; i++) {
+    struct buf *b = bread(log.dev, log.data[i]);
+    bwrite(b);
+    bunpin(b);
+    brelse(b);
+  }
+  log.ndata = 0;
+}
+
 static void commit() {
+  write_data();  // Data first, so metadata never points at stale blocks
   if (log.lh.n > 0) {
     write_log();      // Write modified blocks from cache to log
     write_head();     // Write header to disk -- the real commit
@@ -179,6 +276,8 @@ static void commit() {
     log.lh.n = 0;
     write_head();  // Erase the transaction from the log
   }
+  log.nodata = 0;
+  log.nfreed = 0;
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -203,8 +302,72 @@ void log_write(struct buf *b) {
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
-    bpin(b);
+    if (!undata(b->blockno)) bpin(b);  // a data block is already pinned
     log.lh.n++;
   }
   release(&log.lock);
 }
+
+// Drop block blockno from the data list, if it's there.
+// Caller holds log.lock.
+static int undata(int blockno) {
+  for (int i = 0; i < log.ndata; i++) {
+    if (log.data[i] == blockno) {
+      log.data[i] = log.data[--log.ndata];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Like log_write(), for a block of file data in ordered-data
+// mode: commit() writes the block in place rather than
+// through the log.
+void log_data(struct buf *b) {
+  int i;
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno) break;
+  }
+  if (i < log.lh.n || log.nodata) {
+    // already logged, or reuse isn't safe: log it.
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  if (log.lh.n + log.ndata >= LOGSIZE) panic("too big a transaction");
+  if (log.outstanding < 1) panic("log_data outside of trans");
+  for (i = 0; i < log.ndata; i++) {
+    if (log.data[i] == b->blockno) break;
+  }
+  if (i == log.ndata) {
+    bpin(b);
+    log.data[log.ndata++] = b->blockno;
+  }
+  release(&log.lock);
+}
+
+// Called by bfree(): blockno mustn't be reused for file data,
+// which is written in place, until this transaction commits. If
+// there are too many such blocks to remember, log file data
+// instead until then.
+void log_free(int blockno) {
+  acquire(&log.lock);
+  if (log.nfreed < NFREED)
+    log.freed[log.nfreed++] = blockno;
+  else
+    log.nodata = 1;
+  release(&log.lock);
+}
+
+// Was blockno freed by the running transaction?
+int log_freed(int blockno) {
+  int i;
+
+  acquire(&log.lock);
+  for (i = 0; i < log.nfreed && log.freed[i] != blockno; i++)
+    ;
+  release(&log.lock);
+  return i < log.nfreed;
+}
@@ -20,6 +20,8 @@ void main() {
     kvminithart();       // turn on paging
     procinit();          // process table
     trapinit();          // trap vectors
+    wheelinit();         // sleep timers
+    futexinit();         // futexes
     trapinithart();      // install kernel trap vector
     plicinit();          // set up interrupt controller
     plicinithart();      // ask PLIC for device interrupts
@@ -29,6 +29,7 @@
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define MTIMEHZ 10000000L // CLINT_MTIME cycles per second in qemu.
 
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
@@ -62,6 +63,9 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed regions
+//   thread trapframes, one slot per proc[] entry
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define TTRAPFRAME(i) (TRAPFRAME - ((i) + 1) * PGSIZE)
@@ -0,0 +1,287 @@
+//
+// Memory-mapped files.
+//
+// mmap() records a region of the process's address space in a
+// struct vma; no memory is allocated until the process touches
+// a page. Then usertrap() (or copyin()/copyout() on behalf of a
+// system call) calls mmapfault(), which reads the page from the
+// file into a fresh physical page.
+//
+// A process's threads share its regions and page table, so
+// mmap(), munmap() and mmapfault() hold the process's vmlock while
+// they look at or change them; growproc(), fork() and clone() do
+// too. Reading a page in or writing one back locks the file's
+// inode under vmlock, so no one may wait for vmlock while holding
+// an inode lock: a read() or write() of a file, which copies to
+// or from user memory with the file's inode locked, first reads
+// in the pages it will copy with mmapprefault(), and sets
+// p->nofault so that the copy fails rather than fault one in.
+// Otherwise read(fd, p, n) into an untouched mapping of the same
+// file would deadlock, as would a read() racing a munmap().
+//
+// xv6 has no page cache, so every process has its own copy of
+// each page. A MAP_PRIVATE page is the process's own copy from
+// the moment it is read in, and is never written to the file.
+// Dirty pages of a MAP_SHARED region are written back to the file
+// when they are unmapped, by munmap(), exec() or exit().
+//
+// Regions are placed top-down below the thread trapframes; the
+// heap may not grow into them. A process's threads share its
+// regions, so callers pass the process, p->mm.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return the lowest address used by p's mapped regions,
+// which bounds the heap.
+uint64 mmaplow(struct proc *p) {
+  uint64 low = TTRAPFRAME(NPROC - 1);
+
+  for (struct vma *v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len && v->addr < low) low = v->addr;
+  }
+  return low;
+}
+
+// Return p's region containing va, or 0.
+static struct vma *vmafind(struct proc *p, uint64 va) {
+  for (struct vma *v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len && va >= v->addr && va < v->addr + v->len) return v;
+  }
+  return 0;
+}
+
+static int vmaperm(struct vma *v) {
+  int perm = PTE_U;
+
+  if (v->prot & PROT_READ) perm |= PTE_R;
+  if (v->prot & PROT_WRITE) perm |= PTE_R | PTE_W;
+  if (v->prot & PROT_EXEC) perm |= PTE_X;
+  return perm;
+}
+
+// Map len bytes of f starting at offset off into p's address
+// space. Returns the address of the region, or -1.
+uint64 mmap(struct proc *p, uint64 len, int prot, int flags, struct file *f, uint64 off) {
+  struct vma *v, *free = 0;
+  uint64 addr = -1;
+
+  if (len == 0 || off % PGSIZE != 0 || f->type != FD_INODE) return -1;
+  if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 || (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE))
+    return -1;
+  if (!f->readable) return -1;
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable) return -1;
+
+  acquiresleep(&p->vmlock);
+  for (v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len == 0) {
+      free = v;
+      break;
+    }
+  }
+  len = PGROUNDUP(len);
+  if (free && len <= mmaplow(p) && mmaplow(p) - len >= PGROUNDUP(p->sz)) {
+    addr = mmaplow(p) - len;
+    free->addr = addr;
+    free->len = len;
+    free->prot = prot;
+    free->flags = flags;
+    free->off = off;
+    free->f = filedup(f);
+  }
+  releasesleep(&p->vmlock);
+  return addr;
+}
+
+// Read the page of a mapped region containing va into memory,
+// after a page fault or on behalf of copyin()/copyout().
+// Returns 0, or -1 if va isn't mapped with the access wanted.
+int mmapfault(struct proc *p, uint64 va, int write) {
+  struct vma *v;
+  struct inode *ip;
+  char *mem;
+  int r = -1;
+
+  if (myproc()->nofault) return -1;  // would deadlock; see above
+  va = PGROUNDDOWN(va);
+  acquiresleep(&p->vmlock);
+  if ((v = vmafind(p, va)) == 0) goto out;
+  if (write ? (v->prot & PROT_WRITE) == 0 : (v->prot & (PROT_READ | PROT_WRITE)) == 0) goto out;
+  if (walkaddr(p->pagetable, va) != 0) goto out;  // already present
+  if ((mem = kalloc()) == 0) goto out;
+  memset(mem, 0, PGSIZE);
+  ip = v->f->ip;
+  ilock(ip);
+  readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(ip);
+  if (mappages(p->pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0) {
+    kfree(mem);
+    goto out;
+  }
+  myproc()->nfault++;
+  r = 0;
+out:
+  releasesleep(&p->vmlock);
+  return r;
+}
+
+// Read in the untouched pages of the current process's mapped
+// regions in [va, va+len), for a copy to (if write) or from them
+// that will be made while holding an inode lock or a spin-lock,
+// when pages can't be read in. Pages that can't be read in now
+// are left for the copy to fail on. The regions are looked at
+// without vmlock, to skip the pages that can't need reading in;
+// mmapfault() looks again.
+void mmapprefault(uint64 va, uint64 len, int write) {
+  struct proc *p = myproc();
+  uint64 a;
+
+  for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+    if (vmafind(p->mm, a) && walkaddr(p->pagetable, a) == 0) mmapfault(p->mm, a, write);
+  }
+}
+
+// Write the page at va of shared region v back to its file,
+// if the file was opened for writing.
+static void writeback(struct vma *v, uint64 va, uint64 pa) {
+  struct inode *ip = v->f->ip;
+  uint64 off = v->off + (va - v->addr);
+  uint n;
+
+  if (!v->f->writable) return;
+  begin_op();
+  ilock(ip);
+  // A mapping does not extend the file.
+  if (off < ip->size) {
+    n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+    writei(ip, 0, pa, off, n);
+  }
+  iunlock(ip);
+  end_op();
+}
+
+// Remove the pages of [va, va+len) of region v from p's page
+// table, writing dirty shared pages back to the file.
+static void vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len) {
+  uint64 a;
+  pte_t *pte;
+
+  if (v->flags & MAP_SHARED) {
+    for (a = va; a < va + len; a += PGSIZE) {
+      if ((pte = walk(p->pagetable, a, 0)) != 0 && (*pte & PTE_V) && (*pte & PTE_D)) writeback(v, a, PTE2PA(*pte));
+    }
+  }
+  // Other threads may still be using the pages.
+  uvminval(p->pagetable, va, len / PGSIZE);
+  shootdown(p);
+  uvmfreeinval(p->pagetable, va, len / PGSIZE);
+}
+
+// Unmap [addr, addr+len) of p's address space, which must lie
+// within one mapped region. Returns 0, or -1.
+// Caller must hold p->vmlock.
+static int unmap(struct proc *p, uint64 addr, uint64 len) {
+  struct vma *v, *w;
+  uint64 end;
+
+  len = PGROUNDUP(len);
+  if (addr % PGSIZE != 0 || len == 0 || (v = vmafind(p, addr)) == 0 || addr + len > v->addr + v->len) return -1;
+  end = addr + len;
+
+  // Punching a hole splits the region in two.
+  w = 0;
+  if (addr > v->addr && end < v->addr + v->len) {
+    for (w = p->vma; w < p->vma + NVMA && w->len; w++)
+      ;
+    if (w == p->vma + NVMA) return -1;
+  }
+
+  vmaunmap(p, v, addr, len);
+
+  if (w) {
+    *w = *v;
+    w->addr = end;
+    w->len = v->addr + v->len - end;
+    w->off = v->off + (end - v->addr);
+    filedup(w->f);
+    v->len = addr - v->addr;
+  } else if (addr > v->addr) {
+    v->len = addr - v->addr;
+  } else {
+    v->off += len;
+    v->addr = end;
+    v->len -= len;
+  }
+  if (v->len == 0) fileclose(v->f);
+  return 0;
+}
+
+// Unmap [addr, addr+len) of p's address space, which must lie
+// within one mapped region. Returns 0, or -1.
+int munmap(struct proc *p, uint64 addr, uint64 len) {
+  int r;
+
+  acquiresleep(&p->vmlock);
+  r = unmap(p, addr, len);
+  releasesleep(&p->vmlock);
+  return r;
+}
+
+// Unmap all of p's regions, for exit() and exec().
+void munmapall(struct proc *p) {
+  acquiresleep(&p->vmlock);
+  for (struct vma *v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len) unmap(p, v->addr, v->len);
+  }
+  releasesleep(&p->vmlock);
+}
+
+// Give child np a copy of p's mapped regions, including the
+// pages already read in. Returns 0, or -1 if out of memory.
+// Caller must hold p->vmlock.
+int mmapcopy(struct proc *p, struct proc *np) {
+  struct vma *v;
+  uint64 a;
+  pte_t *pte;
+  char *mem;
+
+  for (v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len == 0) continue;
+    for (a = v->addr; a < v->addr + v->len; a += PGSIZE) {
+      if ((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0) continue;
+      if ((mem = kalloc()) == 0) goto bad;
+      memmove(mem, (char *)PTE2PA(*pte), PGSIZE);
+      if (mappages(np->pagetable, a, PGSIZE, (uint64)mem, PTE_FLAGS(*pte)) != 0) {
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  for (v = p->vma; v < p->vma + NVMA; v++) {
+    np->vma[v - p->vma] = *v;
+    if (v->len) filedup(v->f);
+  }
+  return 0;
+
+bad:
+  // Nothing to write back: drop the pages copied so far.
+  for (v = p->vma; v < p->vma + NVMA; v++) {
+    if (v->len == 0) continue;
+    for (a = v->addr; a < v->addr + v->len; a += PGSIZE) {
+      if ((pte = walk(np->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0) continue;
+      kfree((void *)PTE2PA(*pte));
+      *pte = 0;
+    }
+  }
+  return -1;
+}
@@ -1,13 +1,23 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#ifdef MLFQ
+#define NPRIO         3  // scheduling priority levels
+#else
+#define NPRIO         1  // one level: plain round robin
+#endif
+#define BOOSTTICKS  100  // ticks between raising all processes to the top level
+#define TICKCYCLES  1000000  // CLINT_MTIME cycles per clock tick; about 1/10th second in qemu
 #define NOFILE       16  // open files per process
+#define NVMA         16  // mmap() regions per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // initial number of cached i-nodes
+#define NINODEMAX   500  // maximum number of cached i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
-#define MAXPATH      128   // maximum file path name
+#define LOGSIZE      (MAXOPBLOCKS*6)  // max data blocks in on-disk log
+#define NBUF         (MAXOPBLOCKS*8)  // size of disk block cache
+#define COMMITTICKS  10  // ticks between background log commits
+#define FSSIZE       2000  // size of file system in blocks
+#define MAXPATH      512   // maximum file path name
@@ -3,9 +3,9 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 
 #define PIPESIZE 512
@@ -64,7 +64,9 @@ void pipeclose(struct pipe *pi, int writable) {
     release(&pi->lock);
 }
 
-int pipewrite(struct pipe *pi, uint64 addr, int n) {
+// Write n bytes from addr, a user virtual address if user_src,
+// else a kernel address.
+int pipewrite(struct pipe *pi, int user_src, uint64 addr, int n) {
   int i;
   char ch;
   struct proc *pr = myproc();
@@ -79,7 +81,7 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if (copyin(pr->pagetable, &ch, addr + i, 1) == -1) break;
+    if (either_copyin(&ch, user_src, addr + i, 1) == -1) break;
     pi->data[pi->nwrite++ % PIPESIZE] = ch;
   }
   wakeup(&pi->nread);
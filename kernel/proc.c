@@ -3,21 +3,68 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "resource.h"
+#include "spawn.h"
 
 struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// Descriptor tables: a process needs at most one, which its
+// threads share.
+static struct files files[NPROC];
+
 struct proc *initproc;
 
+// Per-CPU queues of RUNNABLE processes. A process goes on the
+// queue of p->cpu, the CPU it last ran on; an idle CPU steals
+// from the busiest queue.
+//
+// Each queue has NPRIO levels, and the scheduler runs the first
+// process of the highest non-empty level (0). A process that uses
+// up its quantum of quantum(p->prio) ticks drops a level; every
+// BOOSTTICKS all processes go back to level 0. With NPRIO 1 this
+// is round robin with a quantum of one tick.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;  // length; read without the lock when choosing a victim
+} runq[NCPU];
+
+// Sleeping processes, hashed on the channel they sleep on, so
+// that wakeup() looks only at processes that may be waiting. A
+// SLEEPING process's state, and its p->next, are protected by its
+// queue's lock; sleep() links it holding both p->lock and the
+// queue lock, and whoever wakes it unlinks it. Lock order:
+// p->lock, sleep queue lock, run queue lock.
+#define NSLEEPQ 31
+#define SLEEPHASH(chan) (((uint64)(chan) >> 3) % NSLEEPQ)
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+// CPUs that have started scheduling, one bit per CPU.
+static uint64 online;
+
+// Incremented by each boost(); a process whose p->epoch is
+// older has not yet been moved back to level 0.
+static uint epoch;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
-static void wakeup1(struct proc *chan);
+static void kprocstart(void);
+static void wakeup1(struct proc *p, void *chan);
+static void killproc(struct proc *p);
 static void freeproc(struct proc *p);
+static struct files *allocfiles(void);
 
 extern char trampoline[];  // trampoline.S
 
@@ -26,8 +73,12 @@ void procinit(void) {
   struct proc *p;
 
   initlock(&pid_lock, "nextpid");
+  for (struct runq *q = runq; q < &runq[NCPU]; q++) initlock(&q->lock, "runq");
+  for (struct sleepq *q = sleepq; q < &sleepq[NSLEEPQ]; q++) initlock(&q->lock, "sleepq");
   for (p = proc; p < &proc[NPROC]; p++) {
     initlock(&p->lock, "proc");
+    initsleeplock(&p->vmlock, "vm");
+    initlock(&files[p - proc].lock, "files");
 
     // Allocate a page for the process's kernel stack.
     // Map it high in memory, followed by an invalid
@@ -77,6 +128,152 @@ int allocpid() {
   return pid;
 }
 
+// Ticks a process may run at level prio before dropping a level.
+static int quantum(int prio) { return 1 << prio; }
+
+// Move p to level 0 if there has been a boost since it last
+// looked. Caller must hold p->lock.
+static void boosted(struct proc *p) {
+  if (p->epoch != epoch) {
+    p->epoch = epoch;
+    p->prio = 0;
+    p->slice = 0;
+  }
+}
+
+// The CLINT_MTIME of the next clock tick.
+static uint64 nexttick(void) { return (mtime() / TICKCYCLES + 1) * TICKCYCLES; }
+
+// Mark p RUNNABLE and append it to its CPU's run queue: the CPU
+// it last ran on or, if p may no longer run there, the least
+// loaded of the CPUs it may run on.
+// Caller must hold p->lock or, if p is SLEEPING, its sleep
+// queue lock.
+static void runnable(struct proc *p) {
+  struct runq *q;
+
+  if ((p->affinity & (1UL << p->cpu)) == 0) {
+    for (int i = 0, n = -1; i < NCPU; i++) {
+      if ((p->affinity & online & (1UL << i)) && (n < 0 || runq[i].n < n)) {
+        p->cpu = i;
+        n = runq[i].n;
+      }
+    }
+  }
+  q = &runq[p->cpu];
+  p->state = RUNNABLE;
+  boosted(p);
+  acquire(&q->lock);
+  p->next = 0;
+  if (q->tail[p->prio])
+    q->tail[p->prio]->next = p;
+  else
+    q->head[p->prio] = p;
+  q->tail[p->prio] = p;
+  q->n++;
+  release(&q->lock);
+
+  // p's CPU may be idle, or running without a timer. If it is
+  // busy, an idle CPU can steal p.
+  if (cpus[p->cpu].idle) {
+    kickcpu(p->cpu, 0);
+  } else {
+    kickcpu(p->cpu, nexttick());
+    for (struct cpu *c = cpus; c < &cpus[NCPU]; c++) {
+      if (c->idle && (p->affinity & (1UL << (c - cpus)))) {
+        kickcpu(c - cpus, 0);
+        break;
+      }
+    }
+  }
+}
+
+// Remove p, which follows prev (or is first), from level of q.
+// Caller must hold q->lock.
+static void runqdel(struct runq *q, int level, struct proc *prev, struct proc *p) {
+  if (prev)
+    prev->next = p->next;
+  else
+    q->head[level] = p->next;
+  if (q->tail[level] == p) q->tail[level] = prev;
+  q->n--;
+}
+
+// Remove and return the first process of the highest level of q
+// that may run on CPU id, or 0. p->affinity is checked without
+// p->lock; scheduler() checks again.
+static struct proc *dequeue(struct runq *q, int id) {
+  struct proc *p, *prev;
+
+  acquire(&q->lock);
+  for (int i = 0; i < NPRIO; i++) {
+    for (prev = 0, p = q->head[i]; p; prev = p, p = p->next) {
+      if (p->affinity & (1UL << id)) {
+        runqdel(q, i, prev, p);
+        release(&q->lock);
+        return p;
+      }
+    }
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Remove and return a process on CPU id's own queue that may no
+// longer run there, or 0. setaffinity() moves a RUNNABLE process
+// to another queue, but misses one that runnable() has marked
+// RUNNABLE and not yet queued; scheduler() sends it on instead.
+static struct proc *stranded(int id) {
+  struct runq *q = &runq[id];
+  struct proc *p, *prev;
+
+  if (q->n == 0) return 0;
+  acquire(&q->lock);
+  for (int i = 0; i < NPRIO; i++) {
+    for (prev = 0, p = q->head[i]; p; prev = p, p = p->next) {
+      if ((p->affinity & (1UL << id)) == 0) {
+        runqdel(q, i, prev, p);
+        release(&q->lock);
+        return p;
+      }
+    }
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Take p off its run queue, if it is on one. Returns 1 if it was.
+// Caller must hold p->lock.
+static int unqueue(struct proc *p) {
+  struct runq *q = &runq[p->cpu];
+  struct proc *e, *prev;
+
+  acquire(&q->lock);
+  for (int i = 0; i < NPRIO; i++) {
+    for (prev = 0, e = q->head[i]; e; prev = e, e = e->next) {
+      if (e == p) {
+        runqdel(q, i, prev, p);
+        release(&q->lock);
+        return 1;
+      }
+    }
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Take a process that may run on CPU id from the longest run
+// queue of a busy CPU, or return 0. An idle CPU's queue is left
+// to that CPU, whose caches are warm for its processes.
+static struct proc *steal(int id) {
+  struct runq *q, *busiest = 0;
+
+  for (q = runq; q < &runq[NCPU]; q++) {
+    if (q->n > 0 && !cpus[q - runq].idle && (busiest == 0 || q->n > busiest->n)) busiest = q;
+  }
+  return busiest ? dequeue(busiest, id) : 0;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -95,10 +292,24 @@ static struct proc *allocproc(void) {
   return 0;
 
 found:
+  p->state = USED;
   p->pid = allocpid();
+  p->cpu = cpuid();  // interrupts are off while p->lock is held
+  p->affinity = -1;
+  p->nthread = 0;
+  p->mm = p;
+  p->tfva = TRAPFRAME;
+  p->prio = 0;
+  p->slice = 0;
+  p->epoch = epoch;
+  p->utime = p->stime = 0;
+  p->nvcsw = p->nivcsw = 0;
+  p->nfault = p->nsyscall = 0;
+  p->inblock = p->oublock = 0;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
@@ -126,8 +337,14 @@ found:
 static void freeproc(struct proc *p) {
   if (p->trapframe) kfree((void *)p->trapframe);
   p->trapframe = 0;
-  if (p->pagetable) proc_freepagetable(p->pagetable, p->sz);
+  if (p->pagetable) {
+    if (p->mm != p)
+      uvmunmap(p->pagetable, p->tfva, 1, 0);  // a thread: the page table is its process's
+    else
+      proc_freepagetable(p->pagetable, p->sz);
+  }
   p->pagetable = 0;
+  p->mm = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -200,35 +417,130 @@ void userinit(void) {
 
   printf("[210110612] copy initcode to first user process\n");
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  p->files = allocfiles();
+  p->files->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int growproc(int n) {
-  uint sz;
-  struct proc *p = myproc();
+// Start a kernel process that runs fn, which must not return.
+// It has no user memory and never enters user space.
+void kproc(char *name, void (*fn)(void)) {
+  struct proc *p;
 
-  sz = p->sz;
+  if ((p = allocproc()) == 0) panic("kproc");
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  runnable(p);
+  release(&p->lock);
+}
+
+// A kernel process's very first scheduling by scheduler()
+// will swtch to kprocstart.
+static void kprocstart(void) {
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+  myproc()->kfn();
+  panic("kproc returned");
+}
+
+// Grow or shrink user memory by n bytes.
+// Return the old size, or -1 on failure.
+uint64 growproc(int n) {
+  uint sz, oldsz;
+  uint64 a, npages;
+  struct proc *mm = myproc()->mm;
+
+  // The process's threads share its memory.
+  acquiresleep(&mm->vmlock);
+  sz = oldsz = mm->sz;
   if (n > 0) {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if (sz + n > mmaplow(mm) || (sz = uvmalloc(mm->pagetable, sz, sz + n)) == 0) {
+      releasesleep(&mm->vmlock);
       return -1;
     }
-  } else if (n < 0) {
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+  } else if (n < 0 && sz + n < sz) {
+    // Other threads may still be using the pages.
+    a = PGROUNDUP(sz + n);
+    npages = (PGROUNDUP(sz) - a) / PGSIZE;
+    uvminval(mm->pagetable, a, npages);
+    shootdown(mm);
+    uvmfreeinval(mm->pagetable, a, npages);
+    sz += n;
+  }
+  mm->sz = sz;
+  releasesleep(&mm->vmlock);
+  return oldsz;
+}
+
+// Return an unused descriptor table, with one reference, or 0.
+static struct files *allocfiles(void) {
+  struct files *fs;
+
+  for (fs = files; fs < &files[NPROC]; fs++) {
+    acquire(&fs->lock);
+    if (fs->ref == 0) {
+      fs->ref = 1;
+      release(&fs->lock);
+      return fs;
+    }
+    release(&fs->lock);
   }
-  p->sz = sz;
   return 0;
 }
 
+// Return a new descriptor table with the open files and current
+// directory of fs, or 0.
+static struct files *copyfiles(struct files *fs) {
+  struct files *nfs;
+
+  if ((nfs = allocfiles()) == 0) return 0;
+  acquire(&fs->lock);
+  for (int i = 0; i < NOFILE; i++)
+    if (fs->ofile[i]) nfs->ofile[i] = filedup(fs->ofile[i]);
+  nfs->cwd = idup(fs->cwd);
+  release(&fs->lock);
+  return nfs;
+}
+
+// Drop a reference to fs, closing its files and current
+// directory if it was the last.
+static void putfiles(struct files *fs) {
+  acquire(&fs->lock);
+  if (fs->ref > 1) {
+    fs->ref--;
+    release(&fs->lock);
+    return;
+  }
+  release(&fs->lock);
+
+  // No one else can use fs, and allocfiles() won't hand it out
+  // until ref is 0.
+  for (int fd = 0; fd < NOFILE; fd++) {
+    if (fs->ofile[fd]) {
+      fileclose(fs->ofile[fd]);
+      fs->ofile[fd] = 0;
+    }
+  }
+  if (fs->cwd) {
+    begin_op();
+    iput(fs->cwd);
+    end_op();
+    fs->cwd = 0;
+  }
+
+  acquire(&fs->lock);
+  fs->ref = 0;
+  release(&fs->lock);
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int fork(void) {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
 
@@ -237,14 +549,18 @@ int fork(void) {
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
-    freeproc(np);
-    release(&np->lock);
-    return -1;
-  }
-  np->sz = p->sz;
+  // Copying the parent's memory sleeps for its vmlock, so np->lock
+  // can't be held; np is USED, so no one else will take it.
+  release(&np->lock);
 
+  // Copy user memory and open files from parent to child.
+  acquiresleep(&p->mm->vmlock);
+  if (uvmcopy(p->pagetable, np->pagetable, p->mm->sz) < 0) goto bad;
+  np->sz = p->mm->sz;
+  if ((np->files = copyfiles(p->files)) == 0 || mmapcopy(p->mm, np) < 0) goto bad;
+  releasesleep(&p->mm->vmlock);
+
+  acquire(&np->lock);
   np->parent = p;
 
   // copy saved user registers.
@@ -253,22 +569,222 @@ int fork(void) {
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for (i = 0; i < NOFILE; i++)
-    if (p->ofile[i]) np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
-
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->affinity = p->affinity;
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  runnable(np);
+
+  release(&np->lock);
+
+  return pid;
+
+bad:
+  releasesleep(&p->mm->vmlock);
+  if (np->files) putfiles(np->files);
+  np->files = 0;
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
+// Apply spawn()'s file actions to the open files of np, which
+// has its own descriptor table and isn't running yet.
+// Returns 0, or -1 if an action is invalid.
+static int fileactions(struct proc *np, struct spawnfa *fa, int n) {
+  struct file **ofile = np->files->ofile;
+
+  for (; n > 0; fa++, n--) {
+    if (fa->fd < 0 || fa->fd >= NOFILE || ofile[fa->fd] == 0) return -1;
+    switch (fa->op) {
+      case SPAWN_CLOSE:
+        fileclose(ofile[fa->fd]);
+        ofile[fa->fd] = 0;
+        break;
+      case SPAWN_DUP2:
+        if (fa->newfd < 0 || fa->newfd >= NOFILE) return -1;
+        if (fa->newfd == fa->fd) break;
+        if (ofile[fa->newfd]) fileclose(ofile[fa->newfd]);
+        ofile[fa->newfd] = filedup(ofile[fa->fd]);
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Start the program at path in a new child process, as fork()
+// followed by exec() in the child would, but without copying the
+// caller's memory only to throw it away. The child gets the
+// caller's open files, changed by the n actions in fa.
+// Returns the child's pid, or -1.
+int spawn(char *path, char **argv, struct spawnfa *fa, int n) {
+  int argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if ((np = allocproc()) == 0) return -1;
+
+  // Loading the program sleeps, so np->lock can't be held; np is
+  // USED, so no one else will take it.
+  release(&np->lock);
+
+  np->affinity = p->affinity;
 
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  if ((np->files = copyfiles(p->files)) == 0 || fileactions(np, fa, n) < 0 ||
+      (argc = execinto(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+
+  acquire(&np->lock);
+  np->parent = p;
+  pid = np->pid;
+  runnable(np);
   release(&np->lock);
 
   return pid;
+
+bad:
+  if (np->files) putfiles(np->files);
+  np->files = 0;
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
 }
 
+// Create a thread of the current process: a child that shares
+// its page table, memory and mapped regions, and starts at
+// fn(arg) on the given user stack. The thread gets its own
+// trapframe, mapped at the TTRAPFRAME slot of its proc[] entry,
+// and its own kernel stack. It shares the caller's descriptor
+// table and current directory too: a file opened or closed, or a
+// chdir(), by any of the process's threads is seen by all.
+// Returns the new thread's id, a pid, or -1.
+int clone(uint64 fn, uint64 arg, uint64 stack) {
+  int i, tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *mm = p->mm;
+
+  // Count the thread first: np->lock can't be held while
+  // locking its parent.
+  acquire(&mm->lock);
+  mm->nthread++;
+  release(&mm->lock);
+
+  if ((np = allocproc()) == 0) goto bad;
+
+  // Swap np's own page table for the process's, which other
+  // threads may be changing under mm->vmlock. That sleeps, so
+  // np->lock can't be held; np is USED, so no one else will take it.
+  release(&np->lock);
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = mm->pagetable;
+  np->mm = mm;
+  np->tfva = TTRAPFRAME(np - proc);
+  acquiresleep(&mm->vmlock);
+  i = mappages(np->pagetable, np->tfva, PGSIZE, (uint64)np->trapframe, PTE_R | PTE_W);
+  releasesleep(&mm->vmlock);
+  acquire(&np->lock);
+  if (i < 0) {
+    np->pagetable = 0;
+    freeproc(np);
+    release(&np->lock);
+    goto bad;
+  }
+
+  // A process's threads are its children, for join().
+  np->parent = mm;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+
+  acquire(&p->files->lock);
+  p->files->ref++;
+  release(&p->files->lock);
+  np->files = p->files;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->affinity = p->affinity;
+
+  tid = np->pid;
+
+  runnable(np);
+
+  release(&np->lock);
+
+  return tid;
+
+bad:
+  acquire(&mm->lock);
+  mm->nthread--;
+  release(&mm->lock);
+  return -1;
+}
+
+// Wait for an exited thread of process mm, other than the
+// caller, with id tid, or any if tid is 0. Copy its exit status
+// to addr if not 0, free it and return its id. Returns -1 if
+// there is no such thread, or if intr is set and the caller is
+// killed.
+static int reapthread(struct proc *mm, int tid, uint64 addr, int intr) {
+  struct proc *np;
+  struct proc *p = myproc();
+  int found;
+
+  // As in wait(), read in the page the status goes to first.
+  mmapprefault(addr, sizeof(int), 1);
+
+  // hold mm->lock for the whole time to avoid lost
+  // wakeups from a thread's exit().
+  acquire(&mm->lock);
+
+  for (;;) {
+    found = 0;
+    for (np = proc; np < &proc[NPROC]; np++) {
+      // as in wait(), np->parent can't change under us.
+      if (np->parent == mm && np->mm == mm && np != p && (tid == 0 || np->pid == tid)) {
+        acquire(&np->lock);
+        found = 1;
+        if (np->state == ZOMBIE) {
+          tid = np->pid;
+          if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate, sizeof(np->xstate)) < 0) {
+            release(&np->lock);
+            release(&mm->lock);
+            return -1;
+          }
+          freeproc(np);
+          mm->nthread--;
+          release(&np->lock);
+          release(&mm->lock);
+          return tid;
+        }
+        release(&np->lock);
+      }
+    }
+
+    if (!found || (intr && p->killed)) {
+      release(&mm->lock);
+      return -1;
+    }
+
+    // Wait for a thread to exit.
+    sleep(mm, &mm->lock);
+  }
+}
+
+// Wait for thread tid of the current process to exit, or any
+// thread if tid is 0, and return its id; copy its exit status to
+// addr if not 0. Any of the process's threads may join any other.
+int join(int tid, uint64 addr) { return reapthread(myproc()->mm, tid, addr, 1); }
+
 // Pass p's abandoned children to init.
 // Caller must hold p->lock.
 void reparent(struct proc *p) {
@@ -301,19 +817,28 @@ void exit(int status) {
 
   if (p == initproc) panic("init exiting");
 
-  // Close all open files.
-  for (int fd = 0; fd < NOFILE; fd++) {
-    if (p->ofile[fd]) {
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  // A process takes its threads down with it before giving up its
+  // memory. Kill them again after each exit, in case one was still
+  // being cloned.
+  while (p->mm == p && p->nthread > 0) {
+    acquire(&p->lock);
+    for (struct proc *np = proc; np < &proc[NPROC]; np++) {
+      if (np->parent == p && np->mm == p) {
+        acquire(&np->lock);
+        killproc(np);
+        release(&np->lock);
+      }
     }
+    release(&p->lock);
+    reapthread(p, 0, 0, 0);
   }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+  // Write back and unmap mmap()ed files.
+  if (p->mm == p) munmapall(p);
+
+  // Close all open files, unless other threads still share them.
+  putfiles(p->files);
+  p->files = 0;
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -321,7 +846,7 @@ void exit(int status) {
   // necessary or not. init may miss this wakeup, but that seems
   // harmless.
   acquire(&initproc->lock);
-  wakeup1(initproc);
+  wakeup1(initproc, initproc);
   release(&initproc->lock);
 
   // grab a copy of p->parent, to ensure that we unlock the same
@@ -343,8 +868,12 @@ void exit(int status) {
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  // Parent might be sleeping in wait(), or, if p is a thread,
+  // any of the process's other threads in join().
+  if (p->mm != p)
+    wakeup(original_parent);
+  else
+    wakeup1(original_parent, original_parent);
 
   p->xstate = status;
   p->state = ZOMBIE;
@@ -356,13 +885,44 @@ void exit(int status) {
   panic("zombie exit");
 }
 
+// Charge p for the time since p->tstamp: as user time if
+// user is set, else as system time.
+void chargetime(struct proc *p, int user) {
+  uint64 now = mtime();
+
+  if (user)
+    p->utime += now - p->tstamp;
+  else
+    p->stime += now - p->tstamp;
+  p->tstamp = now;
+}
+
+// Fill in *ru with p's resource usage.
+void getrusage(struct proc *p, struct rusage *ru) {
+  ru->utime = p->utime / (MTIMEHZ / 1000000);
+  ru->stime = p->stime / (MTIMEHZ / 1000000);
+  ru->nvcsw = p->nvcsw;
+  ru->nivcsw = p->nivcsw;
+  ru->nfault = p->nfault;
+  ru->nsyscall = p->nsyscall;
+  ru->inblock = p->inblock;
+  ru->oublock = p->oublock;
+}
+
 // Wait for a child process to exit and return its pid.
+// If ruaddr is not 0, copy the child's resource usage there.
 // Return -1 if this process has no children.
-int wait(uint64 addr) {
+int wait(uint64 addr, uint64 ruaddr) {
+  struct rusage ru;
   struct proc *np;
   int havekids, pid;
   struct proc *p = myproc();
 
+  // The status is copied out holding p->lock, when the page can't
+  // be read in.
+  mmapprefault(addr, sizeof(int), 1);
+  mmapprefault(ruaddr, sizeof(ru), 1);
+
   // hold p->lock for the whole time to avoid lost
   // wakeups from a child's exit().
   acquire(&p->lock);
@@ -374,7 +934,8 @@ int wait(uint64 addr) {
       // this code uses np->parent without holding np->lock.
       // acquiring the lock first would cause a deadlock,
       // since np might be an ancestor, and we already hold p->lock.
-      if (np->parent == p) {
+      // p's threads are reaped by join() instead.
+      if (np->parent == p && np->mm == np) {
         // np->parent can't change between the check and the acquire()
         // because only the parent changes it, and we're the parent.
         acquire(&np->lock);
@@ -382,7 +943,9 @@ int wait(uint64 addr) {
         if (np->state == ZOMBIE) {
           // Found one.
           pid = np->pid;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate, sizeof(np->xstate)) < 0) {
+          getrusage(np, &ru);
+          if ((addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate, sizeof(np->xstate)) < 0) ||
+              (ruaddr != 0 && copyout(p->pagetable, ruaddr, (char *)&ru, sizeof(ru)) < 0)) {
             release(&np->lock);
             release(&p->lock);
             return -1;
@@ -407,6 +970,136 @@ int wait(uint64 addr) {
   }
 }
 
+// The CLINT_MTIME at which this CPU next needs a timer interrupt:
+// the next tick if processes are waiting on its run queue, so
+// that the running one can be preempted; on CPU 0, which runs the
+// sleep timers, the next timer deadline; otherwise never (-1).
+static uint64 nextevent(void) {
+  uint64 when = -1, due;
+  int id = cpuid();
+
+  if (runq[id].n > 0) when = nexttick();
+  if (id == 0 && (due = timerdue()) < when) when = due;
+  return when;
+}
+
+// Program this CPU's timer for its next event. Called with
+// interrupts off, after each timer interrupt and before idling.
+void settimer(void) {
+  struct cpu *c = mycpu();
+  uint64 when;
+
+  // Publish the deadline in c->armed before looking again, so that
+  // whoever adds work either sees the deadline and kicks this CPU,
+  // or is seen here.
+  while ((when = nextevent()) != c->armed) {
+    *(volatile uint64 *)CLINT_MTIMECMP(cpuid()) = when;
+    __sync_synchronize();
+    c->armed = when;
+    __sync_synchronize();
+  }
+}
+
+// Make sure CPU id takes a timer interrupt by CLINT_MTIME when,
+// because there will be work for it. Called with interrupts off.
+void kickcpu(int id, uint64 when) {
+  struct cpu *c = &cpus[id];
+
+  __sync_synchronize();
+  if (c->armed <= when) return;
+  *(volatile uint64 *)CLINT_MTIMECMP(id) = when;
+  if (id == cpuid()) c->armed = when;
+}
+
+// Make sure that no other CPU can still be using translations
+// just removed from mm's page table, so that the pages can be
+// freed. Each CPU running one of mm's threads takes a timer
+// interrupt, and shootdown() waits until it has been through
+// usertrapret(), whose return to user space flushes the TLB, or
+// has switched away. Either way it is no longer in the middle of
+// a copyin() or copyout() to a page it looked up before.
+void shootdown(struct proc *mm) {
+  uint64 qs[NCPU];
+  struct cpu *c, *me;
+  struct proc *p;
+
+  push_off();
+  me = mycpu();
+  for (c = cpus; c < &cpus[NCPU]; c++) {
+    qs[c - cpus] = c->qs;
+    __sync_synchronize();
+    if (c != me && (p = c->proc) != 0 && p->mm == mm) kickcpu(c - cpus, 0);
+  }
+  for (c = cpus; c < &cpus[NCPU]; c++) {
+    while (c != me && c->qs == qs[c - cpus] && (p = c->proc) != 0 && p->mm == mm) __sync_synchronize();
+  }
+  pop_off();
+}
+
+// Called for each timer interrupt. Charge the current process
+// for a clock tick, if one has passed since this CPU last
+// charged one: interrupts also come for timers and kickcpu().
+// Returns 1 if it should yield: it has used up its quantum, or
+// there is a process of a higher level waiting on this CPU.
+int preempt(void) {
+  struct proc *p = myproc();
+  struct runq *q;
+  struct cpu *c;
+  int i;
+
+  acquire(&p->lock);
+  if ((p->affinity & (1UL << p->cpu)) == 0) {
+    // setaffinity() has moved p elsewhere.
+    release(&p->lock);
+    p->nivcsw++;
+    return 1;
+  }
+  boosted(p);
+  c = mycpu();  // interrupts are off while p->lock is held
+  if (c->charged != ticks) {
+    c->charged = ticks;
+    p->slice++;
+  }
+  if (p->slice >= quantum(p->prio)) {
+    p->slice = 0;
+    if (p->prio < NPRIO - 1) p->prio++;
+    release(&p->lock);
+    // A switch back to p itself would be useless.
+    if (runq[p->cpu].n == 0) return 0;
+    p->nivcsw++;
+    return 1;
+  }
+  q = &runq[p->cpu];
+  for (i = 0; i < p->prio && q->head[i] == 0; i++)
+    ;
+  release(&p->lock);
+  if (i < p->prio) p->nivcsw++;
+  return i < p->prio;
+}
+
+// Move every queued process to level 0. Running and sleeping
+// processes follow when they next call boosted().
+// Called by clockintr() every BOOSTTICKS.
+void boost(void) {
+  struct runq *q;
+
+  if (NPRIO == 1) return;
+  epoch++;
+  for (q = runq; q < &runq[NCPU]; q++) {
+    acquire(&q->lock);
+    for (int i = 1; i < NPRIO; i++) {
+      if (q->head[i] == 0) continue;
+      if (q->tail[0])
+        q->tail[0]->next = q->head[i];
+      else
+        q->head[0] = q->head[i];
+      q->tail[0] = q->tail[i];
+      q->head[i] = q->tail[i] = 0;
+    }
+    release(&q->lock);
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -417,35 +1110,58 @@ int wait(uint64 addr) {
 void scheduler(void) {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
+  __sync_fetch_and_or(&online, 1UL << id);
   for (;;) {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    int found = 0;
-    for (p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if (p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    if ((p = dequeue(&runq[id], id)) == 0 && (p = stranded(id)) == 0 && (p = steal(id)) == 0) {
+      // Nothing to run: wait for an interrupt, with the timer set
+      // only for work that falls due. A process made RUNNABLE
+      // meanwhile sees c->idle and kicks this CPU. wfi wakes for a
+      // pending interrupt even with interrupts off. Work that
+      // lands on another CPU's queue in the meantime waits for
+      // that CPU.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      settimer();
+      if (runq[id].n == 0) asm volatile("wfi");
+      c->idle = 0;
+      continue;
+    }
 
-        found = 1;
-      }
+    // p is off every queue, so no other CPU can choose it. If it
+    // has just yielded, its old CPU holds p->lock until it is
+    // back in its scheduler.
+    acquire(&p->lock);
+    if (p->state != RUNNABLE) panic("scheduler");
+    if ((p->affinity & (1UL << id)) == 0) {
+      // p is stranded(), or setaffinity() changed p's CPUs after
+      // dequeue() looked.
+      runnable(p);
       release(&p->lock);
+      continue;
     }
-    if (found == 0) {
-      intr_on();
-      asm volatile("wfi");
-    }
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    p->tstamp = mtime();
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    chargetime(p, 0);
+    c->proc = 0;
+    c->qs++;
+    release(&p->lock);
   }
 }
 
@@ -474,7 +1190,7 @@ void sched(void) {
 void yield(void) {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runnable(p);
   sched();
   release(&p->lock);
 }
@@ -502,21 +1218,29 @@ void forkret(void) {
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk) {
   struct proc *p = myproc();
+  struct sleepq *q = &sleepq[SLEEPHASH(chan)];
 
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the sleep queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the queue),
   // so it's okay to release lk.
   if (lk != &p->lock) {  // DOC: sleeplock0
     acquire(&p->lock);   // DOC: sleeplock1
+  }
+  acquire(&q->lock);
+  if (lk != &p->lock) {
     release(lk);
   }
 
   // Go to sleep.
+  p->nvcsw++;
   p->chan = chan;
   p->state = SLEEPING;
+  p->next = q->head;
+  q->head = p;
+  release(&q->lock);
 
   sched();
 
@@ -531,26 +1255,48 @@ void sleep(void *chan, struct spinlock *lk) {
 }
 
 // Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void wakeup(void *chan) {
-  struct proc *p;
-
-  for (p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if (p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+// Must be called without any sleep queue lock.
+void wakeup(void *chan) { wakeupn(chan, NPROC); }
+
+// Wake up at most n of the processes sleeping on chan.
+// Returns the number woken.
+int wakeupn(void *chan, int n) {
+  struct sleepq *q = &sleepq[SLEEPHASH(chan)];
+  struct proc *p, **pp;
+  int woken = 0;
+
+  acquire(&q->lock);
+  for (pp = &q->head; woken < n && (p = *pp) != 0;) {
+    if (p->chan == chan) {
+      *pp = p->next;
+      runnable(p);
+      woken++;
+    } else {
+      pp = &p->next;
     }
-    release(&p->lock);
   }
+  release(&q->lock);
+  return woken;
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
-static void wakeup1(struct proc *p) {
+// Wake up p if it is sleeping on chan, or on anything if chan
+// is 0; used by exit() and kill().
+// Caller must hold p->lock, which keeps p->chan stable.
+static void wakeup1(struct proc *p, void *chan) {
+  struct sleepq *q;
+  struct proc **pp;
+
   if (!holding(&p->lock)) panic("wakeup1");
-  if (p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+  if (p->state != SLEEPING || (chan && p->chan != chan)) return;
+  q = &sleepq[SLEEPHASH(p->chan)];
+  acquire(&q->lock);
+  if (p->state == SLEEPING) {
+    for (pp = &q->head; *pp != p; pp = &(*pp)->next)
+      ;
+    *pp = p->next;
+    runnable(p);
   }
+  release(&q->lock);
 }
 
 // Kill the process with the given pid.
@@ -562,11 +1308,7 @@ int kill(int pid) {
   for (p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
     if (p->pid == pid) {
-      p->killed = 1;
-      if (p->state == SLEEPING) {
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      killproc(p);
       release(&p->lock);
       return 0;
     }
@@ -575,6 +1317,66 @@ int kill(int pid) {
   return -1;
 }
 
+// Mark p killed and make it notice soon: wake it from sleep(),
+// or interrupt the CPU it is running on, which may not otherwise
+// take a timer interrupt.
+// Caller must hold p->lock.
+static void killproc(struct proc *p) {
+  p->killed = 1;
+  wakeup1(p, 0);
+  if (p->state == RUNNING) kickcpu(p->cpu, 0);
+}
+
+// Lock and return the process with the given pid, or the
+// caller if pid is 0. Returns 0 if there is none.
+static struct proc *lockpid(int pid) {
+  struct proc *p;
+
+  if (pid == 0) {
+    p = myproc();
+    acquire(&p->lock);
+    return p;
+  }
+  for (p = proc; p < &proc[NPROC]; p++) {
+    acquire(&p->lock);
+    if (p->pid == pid && p->state != UNUSED) return p;
+    release(&p->lock);
+  }
+  return 0;
+}
+
+// Restrict process pid (or the caller, if pid is 0) to the CPUs
+// in mask, one bit per CPU. A process that must move does so at
+// once if RUNNABLE, and at its next timer interrupt if RUNNING.
+// Returns 0, or -1 if there is no such process or no CPU in mask
+// is running.
+int setaffinity(int pid, uint64 mask) {
+  struct proc *p;
+
+  if ((mask & online) == 0 || (p = lockpid(pid)) == 0) return -1;
+  p->affinity = mask;
+  if ((mask & (1UL << p->cpu)) == 0) {
+    if (p->state == RUNNABLE) {
+      if (unqueue(p)) runnable(p);
+    } else if (p->state == RUNNING) {
+      kickcpu(p->cpu, 0);
+    }
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// Return in *mask the CPUs process pid (or the caller, if pid is
+// 0) may run on. Returns 0, or -1 if there is no such process.
+int getaffinity(int pid, uint64 *mask) {
+  struct proc *p;
+
+  if ((p = lockpid(pid)) == 0) return -1;
+  *mask = p->affinity;
+  release(&p->lock);
+  return 0;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -606,7 +1408,8 @@ int either_copyin(void *dst, int user_src, uint64 src, uint64 len) {
 // No lock to avoid wedging a stuck machine further.
 void procdump(void) {
   static char *states[] = {
-      [UNUSED] "unused", [SLEEPING] "sleep ", [RUNNABLE] "runble", [RUNNING] "run   ", [ZOMBIE] "zombie"};
+      [UNUSED] "unused",   [USED] "used  ",    [SLEEPING] "sleep ",
+      [RUNNABLE] "runble", [RUNNING] "run   ", [ZOMBIE] "zombie"};
   struct proc *p;
   char *state;
 
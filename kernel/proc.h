@@ -24,6 +24,10 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in scheduler() for a process to run?
+  uint64 armed;               // CLINT_MTIMECMP, when the next timer interrupt is due
+  uint64 qs;                  // Times through usertrapret() or a switch; see shootdown()
+  uint charged;               // ticks when preempt() last charged a slice
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,12 +84,35 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+
+// A region of a process's address space mapped by mmap().
+struct vma {
+  uint64 addr;     // page-aligned start
+  uint64 len;      // page-aligned length; 0 if this slot is unused
+  int prot;        // PROT_READ | PROT_WRITE | PROT_EXEC
+  int flags;       // MAP_SHARED or MAP_PRIVATE
+  struct file *f;  // mapped file
+  uint64 off;      // file offset of addr
+};
+
+// Open files and current directory, shared by a process's
+// threads.
+struct files {
+  struct spinlock lock;
+  int ref;                     // Processes using this table
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
 
 // Per-process state
 struct proc {
   struct spinlock lock;
 
+  // held while changing the mapped regions or page table of the
+  // address space p owns, if p->mm == p; see mmap.c.
+  struct sleeplock vmlock;
+
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
@@ -93,14 +120,38 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes on
+  uint64 affinity;             // CPUs p may run on, one bit each
+  int nthread;                 // Threads sharing p's address space
+  int prio;                    // Run queue level, 0 highest
+  int slice;                   // Ticks used at this level
+  uint epoch;                  // Last boost seen
+
+  // runq or sleepq lock must be held when using this:
+  struct proc *next;           // Next process on the run or sleep queue
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  struct proc *mm;             // Owner of the address space: p, or a thread's process
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // User virtual address of trapframe
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct files *files;         // Open files and current directory
+  struct vma vma[NVMA];        // mmap()ed regions
+  void (*kfn)(void);           // Body of a kernel process
+  int nofault;                 // Holding an inode lock: don't read in mmap()ed pages
+
+  // resource usage, for getrusage(); see resource.h.
+  uint64 tstamp;               // CLINT_MTIME when time was last charged
+  uint64 utime;                // User time, in CLINT_MTIME cycles
+  uint64 stime;                // System time, in CLINT_MTIME cycles
+  uint64 nvcsw;                // Voluntary context switches
+  uint64 nivcsw;               // Involuntary context switches
+  uint64 nfault;               // Page faults
+  uint64 nsyscall;             // System calls
+  uint64 inblock;              // Disk blocks read
+  uint64 oublock;              // Disk blocks written
   char name[16];               // Process name (debugging)
 };
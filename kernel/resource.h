@@ -0,0 +1,11 @@
+// Resource usage of a process, from getrusage() and wait2().
+struct rusage {
+  uint64 utime;     // User time, in microseconds
+  uint64 stime;     // System time, in microseconds
+  uint64 nvcsw;     // Voluntary context switches (sleeps)
+  uint64 nivcsw;    // Involuntary context switches (preemptions)
+  uint64 nfault;    // Page faults
+  uint64 nsyscall;  // System calls
+  uint64 inblock;   // Disk blocks read
+  uint64 oublock;   // Disk blocks written
+};
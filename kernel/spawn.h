@@ -0,0 +1,12 @@
+#define SPAWN_MAX 16  // max file actions per spawn()
+
+// File actions for spawn(), applied in order to the child's
+// copy of the caller's open files before the program starts.
+#define SPAWN_CLOSE 1  // close fd
+#define SPAWN_DUP2 2   // make newfd refer to fd's file, as dup2()
+
+struct spawnfa {
+  int op;     // SPAWN_CLOSE or SPAWN_DUP2
+  int fd;     // File descriptor acted on
+  int newfd;  // Target of SPAWN_DUP2
+};
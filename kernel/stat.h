@@ -8,4 +8,13 @@ struct stat {
   short type;  // Type of file
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
+  uint blksize; // File system block size
+};
+
+struct statfs {
+  uint bsize;   // Block size
+  uint blocks;  // Data blocks in file system
+  uint bfree;   // Free blocks
+  uint files;   // Inodes in file system
+  uint ffree;   // Free inodes
 };
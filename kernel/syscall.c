@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -10,7 +11,7 @@
 // Fetch the uint64 at addr from the current process.
 int fetchaddr(uint64 addr, uint64 *ip) {
   struct proc *p = myproc();
-  if (addr >= p->sz || addr + sizeof(uint64) > p->sz) return -1;
+  if (addr >= p->mm->sz || addr + sizeof(uint64) > p->mm->sz) return -1;
   if (copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0) return -1;
   return 0;
 }
@@ -88,6 +89,26 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_lseek(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_sync(void);
+extern uint64 sys_statfs(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_getrusage(void);
+extern uint64 sys_wait2(void);
+extern uint64 sys_sched_setaffinity(void);
+extern uint64 sys_sched_getaffinity(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_futex(void);
 
 static uint64 (*syscalls[])(void) = {
     [SYS_fork] sys_fork,   [SYS_exit] sys_exit,     [SYS_wait] sys_wait,     [SYS_pipe] sys_pipe,
@@ -95,7 +116,13 @@ static uint64 (*syscalls[])(void) = {
     [SYS_chdir] sys_chdir, [SYS_dup] sys_dup,       [SYS_getpid] sys_getpid, [SYS_sbrk] sys_sbrk,
     [SYS_sleep] sys_sleep, [SYS_uptime] sys_uptime, [SYS_open] sys_open,     [SYS_write] sys_write,
     [SYS_mknod] sys_mknod, [SYS_unlink] sys_unlink, [SYS_link] sys_link,     [SYS_mkdir] sys_mkdir,
-    [SYS_close] sys_close,
+    [SYS_close] sys_close, [SYS_mmap] sys_mmap,     [SYS_munmap] sys_munmap, [SYS_sendfile] sys_sendfile,
+    [SYS_readv] sys_readv, [SYS_writev] sys_writev, [SYS_pread] sys_pread, [SYS_pwrite] sys_pwrite,
+    [SYS_lseek] sys_lseek, [SYS_fsync] sys_fsync,   [SYS_sync] sys_sync,
+    [SYS_statfs] sys_statfs, [SYS_nanosleep] sys_nanosleep, [SYS_getrusage] sys_getrusage, [SYS_wait2] sys_wait2,
+    [SYS_sched_setaffinity] sys_sched_setaffinity, [SYS_sched_getaffinity] sys_sched_getaffinity,
+    [SYS_clone] sys_clone, [SYS_join] sys_join, [SYS_spawn] sys_spawn,
+    [SYS_futex] sys_futex,
 };
 
 void syscall(void) {
@@ -103,6 +130,7 @@ void syscall(void) {
   struct proc *p = myproc();
 
   num = p->trapframe->a7;
+  p->nsyscall++;
   if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     p->trapframe->a0 = syscalls[num]();
   } else {
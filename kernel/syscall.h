@@ -20,3 +20,23 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_sendfile 24
+#define SYS_readv 25
+#define SYS_writev 26
+#define SYS_pread 27
+#define SYS_pwrite 28
+#define SYS_lseek 29
+#define SYS_fsync 30
+#define SYS_sync 31
+#define SYS_statfs 32
+#define SYS_nanosleep 33
+#define SYS_getrusage 34
+#define SYS_wait2 35
+#define SYS_sched_setaffinity 36
+#define SYS_sched_getaffinity 37
+#define SYS_clone 38
+#define SYS_join 39
+#define SYS_spawn 40
+#define SYS_futex 41
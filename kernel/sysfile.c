@@ -10,22 +10,29 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
-static int argfd(int n, int *pfd, struct file **pf) {
+// and return the corresponding struct file, with a reference that
+// the caller must drop with fileclose(): another thread sharing the
+// descriptor table may close the descriptor meanwhile.
+static int argfd(int n, struct file **pf) {
   int fd;
   struct file *f;
-
-  if (argint(n, &fd) < 0) return -1;
-  if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0) return -1;
-  if (pfd) *pfd = fd;
-  if (pf) *pf = f;
+  struct files *fs = myproc()->files;
+
+  if (argint(n, &fd) < 0 || fd < 0 || fd >= NOFILE) return -1;
+  acquire(&fs->lock);
+  if ((f = fs->ofile[fd]) != 0) filedup(f);
+  release(&fs->lock);
+  if (f == 0) return -1;
+  *pf = f;
   return 0;
 }
 
@@ -33,52 +40,184 @@ static int argfd(int n, int *pfd, struct file **pf) {
 // Takes over file reference from caller on success.
 static int fdalloc(struct file *f) {
   int fd;
-  struct proc *p = myproc();
+  struct files *fs = myproc()->files;
 
+  acquire(&fs->lock);
   for (fd = 0; fd < NOFILE; fd++) {
-    if (p->ofile[fd] == 0) {
-      p->ofile[fd] = f;
+    if (fs->ofile[fd] == 0) {
+      fs->ofile[fd] = f;
+      release(&fs->lock);
       return fd;
     }
   }
+  release(&fs->lock);
   return -1;
 }
 
+// Free file descriptor fd and return its file, whose reference
+// passes to the caller, or 0 if fd isn't open.
+static struct file *fdfree(int fd) {
+  struct file *f;
+  struct files *fs = myproc()->files;
+
+  acquire(&fs->lock);
+  f = fs->ofile[fd];
+  fs->ofile[fd] = 0;
+  release(&fs->lock);
+  return f;
+}
+
+// Undo fdalloc(f) of fd, dropping the reference, unless another
+// thread sharing the descriptor table has closed fd meanwhile.
+static void fdundo(int fd, struct file *f) {
+  struct files *fs = myproc()->files;
+
+  acquire(&fs->lock);
+  if (fs->ofile[fd] != f) {
+    release(&fs->lock);
+    return;
+  }
+  fs->ofile[fd] = 0;
+  release(&fs->lock);
+  fileclose(f);
+}
+
 uint64 sys_dup(void) {
   struct file *f;
   int fd;
 
-  if (argfd(0, 0, &f) < 0) return -1;
-  if ((fd = fdalloc(f)) < 0) return -1;
-  filedup(f);
+  if (argfd(0, &f) < 0) return -1;
+  // argfd()'s reference goes to the new descriptor.
+  if ((fd = fdalloc(f)) < 0) fileclose(f);
   return fd;
 }
 
 uint64 sys_read(void) {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
-  if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0) return -1;
-  return fileread(f, p, n);
+  if (argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, &f) < 0) return -1;
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64 sys_write(void) {
   struct file *f;
-  int n;
+  int n, r;
+  uint64 p;
+
+  if (argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, &f) < 0) return -1;
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
+}
+
+uint64 sys_pread(void) {
+  struct file *f;
+  int n, off, r;
   uint64 p;
 
-  if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0) return -1;
+  if (argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0) return -1;
+  if (n < 0 || off < 0 || argfd(0, &f) < 0) return -1;
+  r = filepread(f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64 sys_pwrite(void) {
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+
+  if (argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0) return -1;
+  if (n < 0 || off < 0 || argfd(0, &f) < 0) return -1;
+  r = filepwrite(f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64 sys_lseek(void) {
+  struct file *f;
+  int off, whence, r;
+
+  if (argint(1, &off) < 0 || argint(2, &whence) < 0 || argfd(0, &f) < 0) return -1;
+  r = fileseek(f, off, whence);
+  fileclose(f);
+  return r;
+}
+
+// Make fd's file durable. The log commits all files at
+// once, so this is sync() checked against fd.
+uint64 sys_fsync(void) {
+  struct file *f;
+
+  if (argfd(0, &f) < 0) return -1;
+  fileclose(f);
+  log_commit();
+  return 0;
+}
+
+uint64 sys_sync(void) {
+  log_commit();
+  return 0;
+}
+
+uint64 sys_statfs(void) {
+  uint64 addr;
+  struct statfs st;
+
+  if (argaddr(0, &addr) < 0) return -1;
+  fsstat(&st);
+  if (copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
+  return 0;
+}
+
+// Fetch the nth and n+1th system call arguments as an array of
+// iovecs and its length, and copy the array in.
+static int argiov(int n, struct iovec *iov, int *piovcnt) {
+  uint64 uiov, tot = 0;
+  int iovcnt;
+
+  if (argaddr(n, &uiov) < 0 || argint(n + 1, &iovcnt) < 0) return -1;
+  if (iovcnt < 0 || iovcnt > IOV_MAX) return -1;
+  if (copyin(myproc()->pagetable, (char *)iov, uiov, iovcnt * sizeof(struct iovec)) < 0) return -1;
+  for (int i = 0; i < iovcnt; i++) {
+    // The total must fit in the int result.
+    if (iov[i].iov_len > 0x7fffffff || (tot += iov[i].iov_len) > 0x7fffffff) return -1;
+  }
+  *piovcnt = iovcnt;
+  return 0;
+}
+
+uint64 sys_readv(void) {
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int iovcnt, r;
+
+  if (argiov(1, iov, &iovcnt) < 0 || argfd(0, &f) < 0) return -1;
+  r = filereadv(f, iov, iovcnt);
+  fileclose(f);
+  return r;
+}
+
+uint64 sys_writev(void) {
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int iovcnt, r;
 
-  return filewrite(f, p, n);
+  if (argiov(1, iov, &iovcnt) < 0 || argfd(0, &f) < 0) return -1;
+  r = filewritev(f, iov, iovcnt);
+  fileclose(f);
+  return r;
 }
 
 uint64 sys_close(void) {
   int fd;
   struct file *f;
 
-  if (argfd(0, &fd, &f) < 0) return -1;
-  myproc()->ofile[fd] = 0;
+  if (argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE || (f = fdfree(fd)) == 0) return -1;
   fileclose(f);
   return 0;
 }
@@ -86,14 +225,17 @@ uint64 sys_close(void) {
 uint64 sys_fstat(void) {
   struct file *f;
   uint64 st;  // user pointer to struct stat
+  int r;
 
-  if (argfd(0, 0, &f) < 0 || argaddr(1, &st) < 0) return -1;
-  return filestat(f, st);
+  if (argaddr(1, &st) < 0 || argfd(0, &f) < 0) return -1;
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
 uint64 sys_link(void) {
-  char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
+  char name[DIRSIZ + 1], new[MAXPATH], old[MAXPATH];
   struct inode *dp, *ip;
 
   if (argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0) return -1;
@@ -137,22 +279,9 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int isdirempty(struct inode *dp) {
-  int off;
-  struct dirent de;
-
-  for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) panic("isdirempty: readi");
-    if (de.inum != 0) return 0;
-  }
-  return 1;
-}
-
 uint64 sys_unlink(void) {
   struct inode *ip, *dp;
-  struct dirent de;
-  char name[DIRSIZ], path[MAXPATH];
+  char name[DIRSIZ + 1], path[MAXPATH];
   uint off;
 
   if (argstr(0, path, MAXPATH) < 0) return -1;
@@ -177,8 +306,7 @@ uint64 sys_unlink(void) {
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) panic("unlink: writei");
+  dirunlink(dp, name, off);
   if (ip->type == T_DIR) {
     dp->nlink--;
     iupdate(dp);
@@ -201,7 +329,7 @@ bad:
 
 static struct inode *create(char *path, short type, short major, short minor) {
   struct inode *ip, *dp;
-  char name[DIRSIZ];
+  char name[DIRSIZ + 1];
 
   if ((dp = nameiparent(path, name)) == 0) return 0;
 
@@ -215,7 +343,10 @@ static struct inode *create(char *path, short type, short major, short minor) {
     return 0;
   }
 
-  if ((ip = ialloc(dp->dev, type)) == 0) panic("create: ialloc");
+  if ((ip = ialloc(dp->dev, type)) == 0) {
+    iunlockput(dp);
+    return 0;
+  }
 
   ilock(ip);
   ip->major = major;
@@ -227,14 +358,26 @@ static struct inode *create(char *path, short type, short major, short minor) {
     dp->nlink++;        // for ".."
     iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
-    if (dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0) panic("create dots");
+    if (dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0) goto fail;
   }
 
-  if (dirlink(dp, name, ip->inum) < 0) panic("create: dirlink");
+  if (dirlink(dp, name, ip->inum) < 0) goto fail;
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // dp or the disk is full; let iput() free the new inode.
+  if (type == T_DIR) {
+    dp->nlink--;
+    iupdate(dp);
+  }
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 uint64 sys_open(void) {
@@ -273,8 +416,7 @@ uint64 sys_open(void) {
     return -1;
   }
 
-  if ((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0) {
-    if (f) fileclose(f);
+  if ((f = filealloc()) == 0) {
     iunlockput(ip);
     end_op();
     return -1;
@@ -290,6 +432,7 @@ uint64 sys_open(void) {
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->sync = (omode & O_SYNC) != 0;
 
   if ((omode & O_TRUNC) && ip->type == T_FILE) {
     itrunc(ip);
@@ -298,6 +441,9 @@ uint64 sys_open(void) {
   iunlock(ip);
   end_op();
 
+  // Only now that f is complete may other threads sharing the
+  // descriptor table see it.
+  if ((fd = fdalloc(f)) < 0) fileclose(f);
   return fd;
 }
 
@@ -333,7 +479,7 @@ uint64 sys_mknod(void) {
 
 uint64 sys_chdir(void) {
   char path[MAXPATH];
-  struct inode *ip;
+  struct inode *ip, *old;
   struct proc *p = myproc();
 
   begin_op();
@@ -348,23 +494,32 @@ uint64 sys_chdir(void) {
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&p->files->lock);
+  old = p->files->cwd;
+  p->files->cwd = ip;
+  release(&p->files->lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64 sys_exec(void) {
-  char path[MAXPATH], *argv[MAXARG];
+static void freeargv(char **argv) {
+  for (int i = 0; i < MAXARG && argv[i] != 0; i++) kfree(argv[i]);
+}
+
+// Fetch the nth system call argument as a user argv[] array,
+// copying each string into a page of its own; freeargv() frees
+// them.
+static int argargv(int n, char **argv) {
   int i;
   uint64 uargv, uarg;
 
-  if (argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0) {
+  if (argaddr(n, &uargv) < 0) {
     return -1;
   }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG * sizeof(argv[0]));
   for (i = 0;; i++) {
-    if (i >= NELEM(argv)) {
+    if (i >= MAXARG) {
       goto bad;
     }
     if (fetchaddr(uargv + sizeof(uint64) * i, (uint64 *)&uarg) < 0) {
@@ -378,16 +533,43 @@ uint64 sys_exec(void) {
     if (argv[i] == 0) goto bad;
     if (fetchstr(uarg, argv[i], PGSIZE) < 0) goto bad;
   }
+  return 0;
+
+bad:
+  freeargv(argv);
+  return -1;
+}
+
+uint64 sys_exec(void) {
+  char path[MAXPATH], *argv[MAXARG];
+
+  if (argstr(0, path, MAXPATH) < 0 || argargv(1, argv) < 0) {
+    return -1;
+  }
 
   int ret = exec(path, argv);
 
-  for (i = 0; i < NELEM(argv) && argv[i] != 0; i++) kfree(argv[i]);
+  freeargv(argv);
 
   return ret;
+}
 
-bad:
-  for (i = 0; i < NELEM(argv) && argv[i] != 0; i++) kfree(argv[i]);
-  return -1;
+uint64 sys_spawn(void) {
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnfa fa[SPAWN_MAX];
+  uint64 ufa;
+  int nfa;
+
+  if (argstr(0, path, MAXPATH) < 0 || argaddr(2, &ufa) < 0 || argint(3, &nfa) < 0) return -1;
+  if (nfa < 0 || nfa > SPAWN_MAX) return -1;
+  if (copyin(myproc()->pagetable, (char *)fa, ufa, nfa * sizeof(fa[0])) < 0) return -1;
+  if (argargv(1, argv) < 0) return -1;
+
+  int ret = spawn(path, argv, fa, nfa);
+
+  freeargv(argv);
+
+  return ret;
 }
 
 uint64 sys_pipe(void) {
@@ -400,18 +582,66 @@ uint64 sys_pipe(void) {
   if (pipealloc(&rf, &wf) < 0) return -1;
   fd0 = -1;
   if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
-    if (fd0 >= 0) p->ofile[fd0] = 0;
-    fileclose(rf);
+    if (fd0 >= 0)
+      fdundo(fd0, rf);
+    else
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if (copyout(p->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0 ||
       copyout(p->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    fdundo(fd0, rf);
+    fdundo(fd1, wf);
     return -1;
   }
   return 0;
 }
+
+// Map a file into memory. The address argument is only a
+// hint, and is ignored.
+uint64 sys_mmap(void) {
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+      argint(5, &off) < 0)
+    return -1;
+  if (len <= 0 || off < 0 || argfd(4, &f) < 0) return -1;
+  addr = mmap(myproc()->mm, len, prot, flags, f, off);
+  fileclose(f);
+  return addr;
+}
+
+uint64 sys_munmap(void) {
+  uint64 addr;
+  int len;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0) return -1;
+  return munmap(myproc()->mm, addr, len);
+}
+
+// Copy n bytes from file in_fd to out_fd inside the kernel.
+// If off isn't 0 it points to the offset in in_fd to read at,
+// which is updated instead of in_fd's own offset.
+uint64 sys_sendfile(void) {
+  struct file *out, *in;
+  uint64 offp;
+  uint off;
+  int n, r;
+  struct proc *p = myproc();
+
+  if (argaddr(2, &offp) < 0 || argint(3, &n) < 0 || n < 0) return -1;
+  if (offp != 0 && copyin(p->pagetable, (char *)&off, offp, sizeof(off)) < 0) return -1;
+  if (argfd(0, &out) < 0) return -1;
+  if (argfd(1, &in) < 0) {
+    fileclose(out);
+    return -1;
+  }
+  r = filesend(out, in, offp ? &off : &in->off, n);
+  fileclose(out);
+  fileclose(in);
+  if (r >= 0 && offp != 0 && copyout(p->pagetable, offp, (char *)&off, sizeof(off)) < 0) return -1;
+  return r;
+}
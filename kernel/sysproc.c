@@ -5,7 +5,9 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "resource.h"
 
 uint64 sys_exit(void) {
   int n;
@@ -21,35 +23,88 @@ uint64 sys_fork(void) { return fork(); }
 uint64 sys_wait(void) {
   uint64 p;
   if (argaddr(0, &p) < 0) return -1;
-  return wait(p);
+  return wait(p, 0);
+}
+
+uint64 sys_wait2(void) {
+  uint64 p, ru;
+  if (argaddr(0, &p) < 0 || argaddr(1, &ru) < 0) return -1;
+  return wait(p, ru);
+}
+
+uint64 sys_clone(void) {
+  uint64 fn, arg, stack;
+
+  if (argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0) return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64 sys_join(void) {
+  int tid;
+  uint64 p;
+
+  if (argint(0, &tid) < 0 || argaddr(1, &p) < 0) return -1;
+  return join(tid, p);
+}
+
+uint64 sys_futex(void) {
+  uint64 addr;
+  int op, val;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0) return -1;
+  return futex(addr, op, val);
+}
+
+uint64 sys_sched_setaffinity(void) {
+  int pid;
+  uint64 mask;
+
+  if (argint(0, &pid) < 0 || argaddr(1, &mask) < 0) return -1;
+  return setaffinity(pid, mask);
+}
+
+uint64 sys_sched_getaffinity(void) {
+  int pid;
+  uint64 addr, mask;
+
+  if (argint(0, &pid) < 0 || argaddr(1, &addr) < 0) return -1;
+  if (getaffinity(pid, &mask) < 0) return -1;
+  return copyout(myproc()->pagetable, addr, (char *)&mask, sizeof(mask));
+}
+
+uint64 sys_getrusage(void) {
+  uint64 addr;
+  struct rusage ru;
+  struct proc *p = myproc();
+
+  if (argaddr(0, &addr) < 0) return -1;
+  chargetime(p, 0);
+  getrusage(p, &ru);
+  if (copyout(p->pagetable, addr, (char *)&ru, sizeof(ru)) < 0) return -1;
+  return 0;
 }
 
 uint64 sys_sbrk(void) {
-  int addr;
   int n;
 
   if (argint(0, &n) < 0) return -1;
-  addr = myproc()->sz;
-  if (growproc(n) < 0) return -1;
-  return addr;
+  // Another thread may change the size meanwhile, so the old size
+  // must come from growproc().
+  return growproc(n);
 }
 
 uint64 sys_sleep(void) {
   int n;
-  uint ticks0;
 
-  if (argint(0, &n) < 0) return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while (ticks - ticks0 < n) {
-    if (myproc()->killed) {
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if (argint(0, &n) < 0 || n < 0) return -1;
+  return sleepticks(n);
+}
+
+uint64 sys_nanosleep(void) {
+  uint64 ns;
+
+  if (argaddr(0, &ns) < 0) return -1;
+  return nanosleep(ns);
 }
 
 uint64 sys_kill(void) {
@@ -64,6 +119,7 @@ uint64 sys_kill(void) {
 uint64 sys_uptime(void) {
   uint xticks;
 
+  clockintr();
   acquire(&tickslock);
   xticks = ticks;
   release(&tickslock);
@@ -0,0 +1,226 @@
+//
+// Timers, for processes that sleep until a deadline.
+//
+// A pending timer sits on a hierarchical timing wheel: NLEVEL
+// levels of WHEELSIZE slots, where level i holds the timers due
+// within WHEELSIZE^(i+1) ticks, so adding or removing a timer is
+// O(1) and a clock tick looks only at the timers that are due.
+// Each time level 0 wraps around, the current slot of level 1 is
+// re-filed into level 0, and so on up the levels. A timer due
+// later than the wheel spans waits in the farthest slot and is
+// re-filed each time that slot comes round.
+//
+// A sleeping process waits on its own timer, so clockintr()
+// wakes only the processes whose deadline has come. Slot k of the
+// wheel is processed when ticks reaches k, at CLINT_MTIME
+// k*TICKCYCLES; CPU 0 programs its timer for the next slot with
+// work (see settimer() in proc.c), and need not wake otherwise.
+//
+// A deadline that falls between ticks, the remainder of a
+// nanosleep(), waits on the short fine list instead, and CPU 0
+// programs its timer for that CLINT_MTIME exactly.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELMASK (WHEELSIZE - 1)
+#define NLEVEL 4
+#define WHEELSPAN (1UL << (WHEELBITS * NLEVEL))
+
+struct timer {
+  uint64 expires;        // tick at which to fire, or CLINT_MTIME if fine
+  int fired;             // set when expires has passed
+  struct timer *next;    // next in slot
+  struct timer **pprev;  // link that points to this timer
+};
+
+struct {
+  struct spinlock lock;
+  uint64 next;  // next tick to process; ticks + 1
+  struct timer *slot[NLEVEL][WHEELSIZE];
+  struct timer *fine;  // deadlines less than a tick away
+} wheel;
+
+void wheelinit(void) {
+  initlock(&wheel.lock, "timer");
+  wheel.next = 1;
+}
+
+uint64 mtime(void) { return *(volatile uint64 *)CLINT_MTIME; }
+
+// Put t on the list at s.
+// Caller must hold wheel.lock.
+static void tlink(struct timer **s, struct timer *t) {
+  t->next = *s;
+  if (t->next) t->next->pprev = &t->next;
+  t->pprev = s;
+  *s = t;
+}
+
+// File t in the slot for its expiry time.
+// Caller must hold wheel.lock.
+static void tadd(struct timer *t) {
+  uint64 e = t->expires;
+  int i;
+
+  if (e < wheel.next) e = wheel.next;
+  if (e - wheel.next >= WHEELSPAN) e = wheel.next + WHEELSPAN - 1;
+  for (i = 0; e - wheel.next >= 1UL << (WHEELBITS * (i + 1)); i++)
+    ;
+  tlink(&wheel.slot[i][(e >> (WHEELBITS * i)) & WHEELMASK], t);
+}
+
+// Remove t from the wheel.
+// Caller must hold wheel.lock.
+static void tdel(struct timer *t) {
+  *t->pprev = t->next;
+  if (t->next) t->next->pprev = t->pprev;
+}
+
+// Re-file the timers in slot i of level lvl.
+static void cascade(int lvl, int i) {
+  struct timer *t, *next;
+
+  t = wheel.slot[lvl][i];
+  wheel.slot[lvl][i] = 0;
+  for (; t; t = next) {
+    next = t->next;
+    tadd(t);
+  }
+}
+
+// Fire the timers due at the next tick.
+// Called by clockintr() for every tick.
+void timertick(void) {
+  struct timer *t, *next;
+  int i, lvl, j;
+
+  acquire(&wheel.lock);
+  i = wheel.next & WHEELMASK;
+  if (i == 0) {
+    for (lvl = 1; lvl < NLEVEL; lvl++) {
+      j = (wheel.next >> (WHEELBITS * lvl)) & WHEELMASK;
+      cascade(lvl, j);
+      if (j != 0) break;
+    }
+  }
+  t = wheel.slot[0][i];
+  wheel.slot[0][i] = 0;
+  wheel.next++;
+  for (; t; t = next) {
+    next = t->next;
+    t->fired = 1;
+    wakeup(t);
+  }
+  release(&wheel.lock);
+}
+
+// Fire the fine timers whose deadline has passed.
+// Called on CPU 0, which runs the timers, for every timer interrupt.
+void timerfine(void) {
+  struct timer *t, *next;
+  uint64 now;
+
+  acquire(&wheel.lock);
+  now = mtime();
+  for (t = wheel.fine; t; t = next) {
+    next = t->next;
+    if (t->expires <= now) {
+      tdel(t);
+      t->fired = 1;
+      wakeup(t);
+    }
+  }
+  release(&wheel.lock);
+}
+
+// Return the CLINT_MTIME at which timertick() or timerfine() next
+// has work to do, or -1 if no timers are pending. Timers beyond
+// level 0 count from the next cascade, which may be early.
+uint64 timerdue(void) {
+  uint64 k, due = -1, fine = -1;
+  struct timer *t;
+  int lvl, i;
+
+  acquire(&wheel.lock);
+  for (t = wheel.fine; t; t = t->next)
+    if (t->expires < fine) fine = t->expires;
+  for (k = wheel.next; k < wheel.next + WHEELSIZE; k++) {
+    if (wheel.slot[0][k & WHEELMASK]) {
+      due = k;
+      break;
+    }
+  }
+  k = (wheel.next + WHEELMASK) & ~(uint64)WHEELMASK;
+  for (lvl = 1; lvl < NLEVEL && k < due; lvl++) {
+    for (i = 0; i < WHEELSIZE; i++) {
+      if (wheel.slot[lvl][i]) {
+        due = k;
+        break;
+      }
+    }
+  }
+  release(&wheel.lock);
+  if (due != -1 && due * TICKCYCLES < fine) fine = due * TICKCYCLES;
+  return fine;
+}
+
+// Sleep for n clock ticks.
+// Returns 0, or -1 if the process is killed.
+int sleepticks(uint64 n) {
+  struct timer t;
+
+  if (n == 0) return 0;
+  clockintr();  // ticks may be behind if no CPU has been ticking
+  acquire(&wheel.lock);
+  t.expires = wheel.next - 1 + n;
+  t.fired = 0;
+  tadd(&t);
+  kickcpu(0, t.expires * TICKCYCLES);
+  while (!t.fired && !myproc()->killed) sleep(&t, &wheel.lock);
+  if (!t.fired) tdel(&t);
+  release(&wheel.lock);
+  return t.fired ? 0 : -1;
+}
+
+// Sleep until CLINT_MTIME reaches when, on the fine list.
+// Returns 0, or -1 if the process is killed.
+static int sleepfine(uint64 when) {
+  struct timer t;
+
+  acquire(&wheel.lock);
+  t.expires = when;
+  t.fired = 0;
+  tlink(&wheel.fine, &t);
+  kickcpu(0, when);
+  while (!t.fired && !myproc()->killed) sleep(&t, &wheel.lock);
+  if (!t.fired) tdel(&t);
+  release(&wheel.lock);
+  return t.fired ? 0 : -1;
+}
+
+// Sleep for ns nanoseconds. Whole ticks are slept on the wheel,
+// and the rest, less than a tick, on the fine list.
+// Returns 0, or -1 if the process is killed.
+int nanosleep(uint64 ns) {
+  uint64 end, now;
+
+  end = mtime() + (ns * (MTIMEHZ / 1000000) + 999) / 1000;
+  while ((now = mtime()) < end) {
+    if (end - now >= TICKCYCLES) {
+      if (sleepticks((end - now) / TICKCYCLES) < 0) return -1;
+    } else {
+      if (sleepfine(end) < 0) return -1;
+    }
+  }
+  return 0;
+}
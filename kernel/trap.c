@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -35,6 +36,7 @@ void usertrap(void) {
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+  chargetime(p, 1);
 
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -55,6 +57,9 @@ void usertrap(void) {
     syscall();
   } else if ((which_dev = devintr()) != 0) {
     // ok
+  } else if ((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+             mmapfault(p->mm, r_stval(), r_scause() == 15) == 0) {
+    // page of an mmap()ed file read in
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -63,8 +68,8 @@ void usertrap(void) {
 
   if (p->killed) exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2) yield();
+  // give up the CPU if this timer interrupt ends its quantum.
+  if (which_dev == 2 && preempt()) yield();
 
   usertrapret();
 }
@@ -79,6 +84,9 @@ void usertrapret(void) {
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
   intr_off();
+  mycpu()->qs++;
+
+  chargetime(p, 0);
 
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
@@ -109,7 +117,7 @@ void usertrapret(void) {
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64, uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64, uint64))fn)(p->tfva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -129,8 +137,8 @@ void kerneltrap() {
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING) yield();
+  // give up the CPU if this timer interrupt ends its quantum.
+  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && preempt()) yield();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -138,10 +146,17 @@ void kerneltrap() {
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date with CLINT_MTIME, doing the work of each
+// tick that has passed. CPUs take timer interrupts only when they
+// have work due, so ticks may be behind: any CPU can catch it up.
 void clockintr() {
+  if (mtime() < (uint64)(ticks + 1) * TICKCYCLES) return;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  while (mtime() >= (uint64)(ticks + 1) * TICKCYCLES) {
+    ticks++;
+    timertick();
+    if (ticks % BOOSTTICKS == 0) boost();
+  }
   release(&tickslock);
 }
 
@@ -175,16 +190,18 @@ int devintr() {
     return 1;
   } else if (scause == 0x8000000000000001L) {
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
-
-    if (cpuid() == 0) {
-      clockintr();
-    }
+    // forwarded by timervec in kernelvec.S, which has disarmed
+    // the timer.
 
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    mycpu()->armed = -1;
+    if (cpuid() == 0) timerfine();
+    clockintr();
+    settimer();
+
     return 2;
   } else {
     return 0;
@@ -0,0 +1,6 @@
+#define IOV_MAX 16  // max iovecs per readv()/writev()
+
+struct iovec {
+  void *iov_base;  // Start of buffer
+  uint64 iov_len;  // Bytes in buffer
+};
@@ -148,7 +148,7 @@ static int alloc3_desc(int *idx) {
 }
 
 void virtio_disk_rw(struct buf *b, int write) {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = b->blockno * (b->size / 512);
 
   acquire(&disk.vdisk_lock);
 
@@ -189,7 +189,7 @@ void virtio_disk_rw(struct buf *b, int write) {
   disk.desc[idx[0]].next = idx[1];
 
   disk.desc[idx[1]].addr = (uint64)b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  disk.desc[idx[1]].len = b->size;
   if (write)
     disk.desc[idx[1]].flags = 0;  // device reads b->data
   else
@@ -5,6 +5,9 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -210,6 +213,30 @@ uint64 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
   return newsz;
 }
 
+// Unmap npages pages from va, which need not all be mapped, from
+// a page table that threads on other CPUs may be using, in two
+// steps: uvminval() marks the PTEs invalid but keeps the pages'
+// physical addresses, and once shootdown() has made sure that no
+// CPU still uses them, uvmfreeinval() frees the pages.
+void uvminval(pagetable_t pagetable, uint64 va, uint64 npages) {
+  pte_t *pte;
+
+  for (uint64 a = va; a < va + npages * PGSIZE; a += PGSIZE) {
+    if ((pte = walk(pagetable, a, 0)) != 0) *pte &= ~PTE_V;
+  }
+}
+
+void uvmfreeinval(pagetable_t pagetable, uint64 va, uint64 npages) {
+  pte_t *pte;
+
+  for (uint64 a = va; a < va + npages * PGSIZE; a += PGSIZE) {
+    if ((pte = walk(pagetable, a, 0)) != 0 && *pte != 0) {
+      kfree((void *)PTE2PA(*pte));
+      *pte = 0;
+    }
+  }
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -291,6 +318,30 @@ void uvmclear(pagetable_t pagetable, uint64 va) {
   *pte &= ~PTE_U;
 }
 
+// Like walkaddr(), but first read in the page if va is in an
+// mmap()ed region of the current process that hasn't been
+// touched yet. That needs to sleep, so can't be done while
+// holding a spin-lock (with interrupts off), as piperead() and
+// pipewrite() do.
+// For a write, the page must be writable, as the MMU doesn't
+// check when the kernel writes through pa; the page is then
+// marked dirty, or munmap() wouldn't write back a MAP_SHARED page
+// filled by read().
+static uint64 useraddr(pagetable_t pagetable, uint64 va, int write) {
+  struct proc *p = myproc();
+  uint64 pa;
+  pte_t *pte;
+
+  if ((pa = walkaddr(pagetable, va)) == 0 && p != 0 && pagetable == p->pagetable && intr_get() &&
+      mmapfault(p->mm, va, write) == 0)
+    pa = walkaddr(pagetable, va);
+  if (pa != 0 && write) {
+    if ((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_W) == 0) return 0;
+    *pte |= PTE_D | PTE_A;
+  }
+  return pa;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -299,7 +350,7 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
 
   while (len > 0) {
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = useraddr(pagetable, va0, 1);
     if (pa0 == 0) return -1;
     n = PGSIZE - (dstva - va0);
     if (n > len) n = len;
@@ -320,7 +371,7 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
 
   while (len > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = useraddr(pagetable, va0, 0);
     if (pa0 == 0) return -1;
     n = PGSIZE - (srcva - va0);
     if (n > len) n = len;
@@ -343,7 +394,7 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
 
   while (got_null == 0 && max > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = useraddr(pagetable, va0, 0);
     if (pa0 == 0) return -1;
     n = PGSIZE - (srcva - va0);
     if (n > max) n = max;
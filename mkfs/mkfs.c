@@ -4,6 +4,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "kernel/types.h"
@@ -20,20 +22,25 @@
   } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 200  // per MINBSIZE of block size
+#define NTHREAD 8    // most threads copying files at once
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE / (BSIZE * 8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// With blocks bigger than SBOFF the super block is in the boot block.
+
+uint bsize = BSIZE;  // block size, set with -b
+uint fsflags;        // SB_* options; -o sets SB_ORDERED
+int ninodes;
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE + 1;  // header and LOGSIZE blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+uchar *img;  // the image, built in place in the mapped output file
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -44,6 +51,15 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void ifile(uint inum, int fd, char *name);
+void copyfiles(void);
+// A directory entry to be written by wdir().
+struct ent {
+  uint inum;
+  char name[DIRSIZ + 1];
+};
+
+void wdir(uint inum, struct ent *e, int n);
 
 // convert to intel byte order
 ushort xshort(ushort x) {
@@ -65,64 +81,85 @@ uint xint(uint x) {
 }
 
 int main(int argc, char *argv[]) {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, fd, nent;
+  uint rootino, inum, logstart;
+  struct ent *ents;
   char buf[BSIZE];
-  struct dinode din;
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for (;;) {
+    if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+      bsize = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 1 && strcmp(argv[1], "-o") == 0) {
+      fsflags |= SB_ORDERED;
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+  }
+  if (argc < 2 || bsize < MINBSIZE || bsize > BSIZE || (bsize & (bsize - 1)) != 0) {
+    fprintf(stderr, "Usage: mkfs [-b 1024|2048|4096] [-o] fs.img files...\n");
     exit(1);
   }
 
-  assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert((bsize % sizeof(struct dinode)) == 0);
 
+  // FSSIZE blocks make a disk that grows with the block size,
+  // so scale the number of inodes with it too.
+  ninodes = NINODES * (bsize / MINBSIZE);
+  nbitmap = FSSIZE / (bsize * 8) + 1;
+  ninodeblocks = ninodes / IPB(bsize) + 1;
+
+  // Build the image in memory, mapped from the output file.
   fsfd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
-  if (fsfd < 0) {
+  if (fsfd < 0 || ftruncate(fsfd, (off_t)FSSIZE * bsize) < 0) {
     perror(argv[1]);
     exit(1);
   }
+  img = mmap(0, (size_t)FSSIZE * bsize, PROT_READ | PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if (img == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  logstart = SBOFF / bsize + 1;
+  nmeta = logstart + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2 + nlog);
-  sb.bmapstart = xint(2 + nlog + ninodeblocks);
+  sb.logstart = xint(logstart);
+  sb.inodestart = xint(logstart + nlog);
+  sb.bmapstart = xint(logstart + nlog + ninodeblocks);
+  sb.bsize = xint(bsize);
+  sb.flags = xint(fsflags);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n", nmeta, nlog,
-         ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("bsize %d nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n", bsize,
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;  // the first free block that we can allocate
 
-  for (i = 0; i < FSSIZE; i++) wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(buf + SBOFF % bsize, &sb, sizeof(sb));
+  wsect(SBOFF / bsize, buf);
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  nent = 0;
+  ents = calloc(argc, sizeof(struct ent));
+  ents[nent].inum = rootino;
+  strcpy(ents[nent++].name, ".");
+  ents[nent].inum = rootino;
+  strcpy(ents[nent++].name, "..");
 
   for (i = 2; i < argc; i++) {
     // get rid of "user/"
@@ -147,37 +184,36 @@ int main(int argc, char *argv[]) {
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(strlen(shortname) <= DIRSIZ);
+    ents[nent].inum = inum;
+    strcpy(ents[nent++].name, shortname);
 
-    while ((cc = read(fd, buf, sizeof(buf))) > 0) iappend(inum, buf, cc);
-
-    close(fd);
+    ifile(inum, fd, argv[i]);
   }
+  copyfiles();
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off / BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, ents, nent);
+  free(ents);
 
   balloc(freeblock);
 
+  // Now that everything is allocated, record what's left.
+  sb.nfree = xint(FSSIZE - freeblock);
+  sb.nifree = xint(ninodes - freeinode);
+  memset(buf, 0, sizeof(buf));
+  memmove(buf + SBOFF % bsize, &sb, sizeof(sb));
+  wsect(SBOFF / bsize, buf);
+
+  if (munmap(img, (size_t)FSSIZE * bsize) < 0 || close(fsfd) < 0) {
+    perror(argv[1]);
+    exit(1);
+  }
   exit(0);
 }
 
 void wsect(uint sec, void *buf) {
-  if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
-    perror("lseek");
-    exit(1);
-  }
-  if (write(fsfd, buf, BSIZE) != BSIZE) {
-    perror("write");
-    exit(1);
-  }
+  assert(sec < FSSIZE);
+  memmove(img + (size_t)sec * bsize, buf, bsize);
 }
 
 void winode(uint inum, struct dinode *ip) {
@@ -187,7 +223,7 @@ void winode(uint inum, struct dinode *ip) {
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode *)buf) + (inum % IPB);
+  dip = ((struct dinode *)buf) + (inum % IPB(bsize));
   *dip = *ip;
   wsect(bn, buf);
 }
@@ -199,19 +235,13 @@ void rinode(uint inum, struct dinode *ip) {
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode *)buf) + (inum % IPB);
+  dip = ((struct dinode *)buf) + (inum % IPB(bsize));
   *ip = *dip;
 }
 
 void rsect(uint sec, void *buf) {
-  if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
-    perror("lseek");
-    exit(1);
-  }
-  if (read(fsfd, buf, BSIZE) != BSIZE) {
-    perror("read");
-    exit(1);
-  }
+  assert(sec < FSSIZE);
+  memmove(buf, img + (size_t)sec * bsize, bsize);
 }
 
 uint ialloc(ushort type) {
@@ -222,6 +252,7 @@ uint ialloc(ushort type) {
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if (type == T_FILE) din.flags = xint(DI_INLINE);
   winode(inum, &din);
   return inum;
 }
@@ -231,8 +262,8 @@ void balloc(int used) {
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE * 8);
-  bzero(buf, BSIZE);
+  assert(used < bsize * 8);
+  bzero(buf, bsize);
   for (i = 0; i < used; i++) {
     buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
   }
@@ -247,15 +278,32 @@ void iappend(uint inum, void *xp, int n) {
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  uint indirect[NINDIRECT(BSIZE)];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if (xint(din.flags) & DI_INLINE) {
+    if (off + n <= NINLINE) {
+      bcopy(p, din.idata + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    // move the inline data to a block of its own
+    bzero(buf, bsize);
+    bcopy(din.idata, buf, off);
+    bzero(din.idata, NINLINE);
+    din.flags = xint(xint(din.flags) & ~DI_INLINE);
+    if (off > 0) {
+      din.addrs[0] = xint(freeblock++);
+      wsect(xint(din.addrs[0]), buf);
+    }
+  }
   while (n > 0) {
-    fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
+    fbn = off / bsize;
+    assert(fbn < MAXFILE(bsize));
     if (fbn < NDIRECT) {
       if (xint(din.addrs[fbn]) == 0) {
         din.addrs[fbn] = xint(freeblock++);
@@ -272,9 +320,9 @@ void iappend(uint inum, void *xp, int n) {
       }
       x = xint(indirect[fbn - NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * BSIZE - off);
+    n1 = min(n, (fbn + 1) * bsize - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
+    bcopy(p, buf + off - (fbn * bsize), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
@@ -283,3 +331,193 @@ void iappend(uint inum, void *xp, int n) {
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// A file whose contents copyfiles() reads into its blocks.
+struct copy {
+  int fd;
+  char *name;
+  uint start;  // first data block
+  uint size;
+};
+
+struct copy *copies;
+int ncopy;
+int nextcopy;  // next copy for a thread to take
+pthread_mutex_t copylock = PTHREAD_MUTEX_INITIALIZER;
+
+// Give inode inum the contents of the file open on fd. A small
+// file goes inline right away; a bigger one gets consecutive
+// data blocks, followed by its indirect block, and is read
+// into them later by copyfiles().
+void ifile(uint inum, int fd, char *name) {
+  struct dinode din;
+  uint indirect[NINDIRECT(BSIZE)];
+  off_t size;
+  uint nb, fbn;
+
+  if ((size = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+    perror(name);
+    exit(1);
+  }
+  rinode(inum, &din);
+  if (size <= NINLINE) {
+    if (read(fd, din.idata, size) != size) {
+      perror(name);
+      exit(1);
+    }
+    close(fd);
+    din.size = xint(size);
+    winode(inum, &din);
+    return;
+  }
+
+  nb = (size + bsize - 1) / bsize;
+  assert(nb <= MAXFILE(bsize));
+  din.flags = xint(xint(din.flags) & ~DI_INLINE);
+  bzero(din.idata, NINLINE);
+  bzero(indirect, sizeof(indirect));
+  for (fbn = 0; fbn < nb; fbn++) {
+    if (fbn < NDIRECT)
+      din.addrs[fbn] = xint(freeblock + fbn);
+    else
+      indirect[fbn - NDIRECT] = xint(freeblock + fbn);
+  }
+  copies = realloc(copies, (ncopy + 1) * sizeof(*copies));
+  copies[ncopy++] = (struct copy){fd, name, freeblock, size};
+  freeblock += nb;
+  if (nb > NDIRECT) {
+    din.addrs[NDIRECT] = xint(freeblock);
+    wsect(freeblock++, indirect);
+  }
+  assert(freeblock < FSSIZE);
+  din.size = xint(size);
+  winode(inum, &din);
+}
+
+void *copier(void *arg) {
+  struct copy *c;
+  uint n;
+  ssize_t cc;
+
+  for (;;) {
+    pthread_mutex_lock(&copylock);
+    c = nextcopy < ncopy ? &copies[nextcopy++] : 0;
+    pthread_mutex_unlock(&copylock);
+    if (c == 0) return 0;
+    for (n = 0; n < c->size; n += cc) {
+      if ((cc = read(c->fd, img + (size_t)c->start * bsize + n, c->size - n)) <= 0) {
+        fprintf(stderr, "mkfs: %s: short read\n", c->name);
+        exit(1);
+      }
+    }
+    close(c->fd);
+  }
+}
+
+// Read the files laid out by ifile() into the image, several
+// at a time.
+void copyfiles(void) {
+  pthread_t t[NTHREAD];
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, n;
+
+  n = ncpu < 1 ? 1 : ncpu > NTHREAD ? NTHREAD : ncpu;
+  if (n > ncopy) n = ncopy;
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&t[i], 0, copier, 0) != 0) {
+      fprintf(stderr, "mkfs: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < n; i++) pthread_join(t[i], 0);
+  free(copies);
+}
+
+int dxcmp(const void *a, const void *b) {
+  const char *na = ((struct ent *)a)->name, *nb = ((struct ent *)b)->name;
+  uint ha = dxhash(na, strlen(na));
+  uint hb = dxhash(nb, strlen(nb));
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+uint enthash(struct ent *e) { return dxhash(e->name, strlen(e->name)); }
+
+// Number of the entries e[i..n) that fit in one directory block.
+int nfit(struct ent *e, int i, int n) {
+  int k, used = 0;
+
+  for (k = 0; i + k < n && used + DIRREC(strlen(e[i + k].name)) <= bsize; k++) used += DIRREC(strlen(e[i + k].name));
+  return k;
+}
+
+// Number of the hash-sorted entries e[i..n) that go in the next
+// leaf: as many as fit, without splitting equal hashes across leaves.
+int dxleaf(struct ent *e, int i, int n) {
+  int k = nfit(e, i, n);
+
+  while (i + k < n && k > 1 && enthash(&e[i + k - 1]) == enthash(&e[i + k])) k--;
+  return k;
+}
+
+// Put the record for e at offset off of directory block buf,
+// reaching to offset end. Returns the offset after the record.
+int wrec(char *buf, int off, int end, struct ent *e) {
+  struct dirent *de = (struct dirent *)(buf + off);
+  int len = strlen(e->name);
+
+  de->inum = xint(e->inum);
+  de->reclen = xshort(end - off);
+  de->namelen = len;
+  memmove(de->name, e->name, len);
+  return off + DIRREC(len);
+}
+
+// Write a directory block holding the k entries e[], the last
+// record taking up the rest of the block.
+void wblock(uint inum, struct ent *e, int k) {
+  char buf[BSIZE];
+  int j, off;
+
+  bzero(buf, bsize);
+  ((struct dirent *)buf)->reclen = xshort(bsize);
+  for (j = 0, off = 0; j < k; j++) off = wrec(buf, off, j == k - 1 ? bsize : off + DIRREC(strlen(e[j].name)), &e[j]);
+  iappend(inum, buf, bsize);
+}
+
+// Write the n entries of directory inum, starting with "." and "..".
+// A directory that doesn't fit in one block is written indexed,
+// with its entries sorted by hash into full leaves.
+void wdir(uint inum, struct ent *e, int n) {
+  char buf[BSIZE];
+  struct dxhdr *hdr;
+  struct dxentry *x;
+  int i, k;
+
+  if (nfit(e, 0, n) == n) {
+    wblock(inum, e, n);
+    return;
+  }
+
+  qsort(e + 2, n - 2, sizeof(*e), dxcmp);
+
+  // "." and ".." followed by the index, inside the ".." record.
+  bzero(buf, bsize);
+  wrec(buf, wrec(buf, 0, DIRREC(1), &e[0]), bsize, &e[1]);
+  hdr = (struct dxhdr *)(buf + DXOFF);
+  hdr->magic = xint(DXMAGIC);
+  x = (struct dxentry *)(hdr + 1);
+  for (i = 2; i < n; i += dxleaf(e, i, n)) {
+    assert(xint(hdr->count) < DXLIMIT(bsize));
+    x->hash = xint(i == 2 ? 0 : enthash(&e[i]));
+    x->block = xint(1 + xint(hdr->count));
+    hdr->count = xint(xint(hdr->count) + 1);
+    x++;
+  }
+  iappend(inum, buf, bsize);
+
+  for (i = 2; i < n; i += k) {
+    k = dxleaf(e, i, n);
+    wblock(inum, e + i, k);
+  }
+}
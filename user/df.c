@@ -0,0 +1,17 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Print how full the file system is.
+int main(int argc, char *argv[]) {
+  struct statfs st;
+
+  if (statfs(&st) < 0) {
+    fprintf(2, "df: statfs failed\n");
+    exit(1);
+  }
+  printf("block size %d\n", st.bsize);
+  printf("blocks %d used %d free %d\n", st.blocks, st.blocks - st.bfree, st.bfree);
+  printf("inodes %d used %d free %d\n", st.files, st.files - st.ffree, st.ffree);
+  exit(0);
+}
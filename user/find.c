@@ -16,9 +16,9 @@ char* fmtname(char *path)
 
 void find(char *path, char *file_name)
 {
-  char buf[512], *p;
-  int fd;
-  struct dirent de;
+  char buf[512], *blk, *p;
+  int fd, off, n;
+  struct dirent *de;
   struct stat st;
 
   if((fd = open(path, 0)) < 0){
@@ -48,21 +48,29 @@ void find(char *path, char *file_name)
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
+    //按块读取文件夹，块放在堆上以免递归时栈溢出
+    blk = malloc(BSIZE);
     //读取文件夹下的每一个文件
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf("ls: cannot stat %s\n", buf);
-        continue;
-      }
-      //递归find，但不递归进入.和..
-      if(strcmp(fmtname(buf), ".") != 0 && strcmp(fmtname(buf), "..") != 0) {
-        find(buf, file_name);
+    while((n = read(fd, blk, BSIZE)) > 0){
+      for(off = 0; off < n; off += de->reclen){
+        de = (struct dirent*)(blk + off);
+        if(de->reclen == 0)
+          break;
+        if(de->inum == 0)
+          continue;
+        memmove(p, de->name, de->namelen);
+        p[de->namelen] = 0;
+        if(stat(buf, &st) < 0){
+          printf("ls: cannot stat %s\n", buf);
+          continue;
+        }
+        //递归find，但不递归进入.和..
+        if(strcmp(fmtname(buf), ".") != 0 && strcmp(fmtname(buf), "..") != 0) {
+          find(buf, file_name);
+        }
       }
     }
+    free(blk);
     break;
   }
   close(fd);
@@ -2,28 +2,39 @@
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/uio.h"
 #include "user/user.h"
 
 char buf[1024];
 int match(char *, char *);
 
 void grep(char *pattern, int fd) {
-  int n, m;
+  int n, m, nv;
   char *p, *q;
+  struct iovec iov[IOV_MAX];
 
   m = 0;
   while ((n = read(fd, buf + m, sizeof(buf) - m - 1)) > 0) {
     m += n;
     buf[m] = '\0';
     p = buf;
+    nv = 0;
+    // Gather the matching lines and write them together.
     while ((q = strchr(p, '\n')) != 0) {
       *q = 0;
       if (match(pattern, p)) {
         *q = '\n';
-        write(1, p, q + 1 - p);
+        if (nv == IOV_MAX) {
+          writev(1, iov, nv);
+          nv = 0;
+        }
+        iov[nv].iov_base = p;
+        iov[nv].iov_len = q + 1 - p;
+        nv++;
       }
       p = q + 1;
     }
+    if (nv > 0) writev(1, iov, nv);
     if (m > 0) {
       m -= p - buf;
       memmove(buf, p, m);
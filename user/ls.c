@@ -3,8 +3,10 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 
+#define NAMEWIDTH 14
+
 char *fmtname(char *path) {
-  static char buf[DIRSIZ + 1];
+  static char buf[NAMEWIDTH + 1];
   char *p;
 
   // Find first character after last slash.
@@ -13,16 +15,17 @@ char *fmtname(char *path) {
   p++;
 
   // Return blank-padded name.
-  if (strlen(p) >= DIRSIZ) return p;
+  if (strlen(p) >= NAMEWIDTH) return p;
   memmove(buf, p, strlen(p));
-  memset(buf + strlen(p), ' ', DIRSIZ - strlen(p));
+  memset(buf + strlen(p), ' ', NAMEWIDTH - strlen(p));
   return buf;
 }
 
 void ls(char *path) {
+  static char blk[BSIZE];
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, off, n;
+  struct dirent *de;
   struct stat st;
 
   if ((fd = open(path, 0)) < 0) {
@@ -49,15 +52,21 @@ void ls(char *path) {
       strcpy(buf, path);
       p = buf + strlen(buf);
       *p++ = '/';
-      while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-        if (de.inum == 0) continue;
-        memmove(p, de.name, DIRSIZ);
-        p[DIRSIZ] = 0;
-        if (stat(buf, &st) < 0) {
-          printf("ls: cannot stat %s\n", buf);
-          continue;
+      // Records never cross a block boundary, so reading
+      // BSIZE, the largest block size, gets whole records.
+      while ((n = read(fd, blk, BSIZE)) > 0) {
+        for (off = 0; off < n; off += de->reclen) {
+          de = (struct dirent *)(blk + off);
+          if (de->reclen == 0) break;
+          if (de->inum == 0) continue;
+          memmove(p, de->name, de->namelen);
+          p[de->namelen] = 0;
+          if (stat(buf, &st) < 0) {
+            printf("ls: cannot stat %s\n", buf);
+            continue;
+          }
+          printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
         }
-        printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
       }
       break;
   }
@@ -0,0 +1,56 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/futex.h"
+#include "user/user.h"
+
+// Mutexes and condition variables for threads, on futex().
+//
+// A mutex is 0 when unlocked, 1 when locked, and 2 when locked
+// with threads perhaps waiting, so that unlocking enters the
+// kernel only if someone may be asleep. A condition variable is
+// a sequence number bumped by each signal: a waiter sleeps only
+// while it is unchanged, so a signal between unlocking the mutex
+// and sleeping isn't lost.
+
+void mutex_init(struct mutex *m) { m->state = 0; }
+
+void mutex_lock(struct mutex *m) {
+  int c;
+
+  if ((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0) return;
+  // Mark it contended, then sleep until it is unlocked.
+  if (c != 2) c = __sync_lock_test_and_set(&m->state, 2);
+  while (c != 0) {
+    futex(&m->state, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void mutex_unlock(struct mutex *m) {
+  if (__sync_fetch_and_sub(&m->state, 1) != 1) {
+    __sync_lock_release(&m->state);
+    futex(&m->state, FUTEX_WAKE, 1);
+  }
+}
+
+void cond_init(struct cond *c) { c->seq = 0; }
+
+// Wait for cond_signal() or cond_broadcast(), with m held.
+// May return spuriously, so check the condition again.
+void cond_wait(struct cond *c, struct mutex *m) {
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  mutex_lock(m);
+}
+
+void cond_signal(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void cond_broadcast(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, NPROC);
+}
@@ -1,16 +1,56 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/uio.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
 static char digits[] = "0123456789ABCDEF";
 
-static void putc(int fd, char c) { write(fd, &c, 1); }
+// Output is gathered as a vector of pieces of the format string,
+// %s arguments, and converted numbers, and written with one
+// writev() per call (or per IOV_MAX pieces).
+struct out {
+  int fd;
+  int n;                      // pieces in iov
+  struct iovec iov[IOV_MAX];  // the pieces
+  int used;                   // bytes of num[] in use
+  char num[IOV_MAX * 24];     // room for a conversion per piece
+};
 
-static void printint(int fd, int xx, int base, int sgn) {
-  char buf[16];
-  int i, neg;
+static void flush(struct out *o) {
+  if (o->n > 0) writev(o->fd, o->iov, o->n);
+  o->n = 0;
+  o->used = 0;
+}
+
+static void put(struct out *o, const char *s, int n) {
+  if (n == 0) return;
+  if (o->n == IOV_MAX) flush(o);
+  o->iov[o->n].iov_base = (void *)s;
+  o->iov[o->n].iov_len = n;
+  o->n++;
+}
+
+// Return space for a converted number, to be passed to putnum().
+static char *numbuf(struct out *o) {
+  if (o->n == IOV_MAX) flush(o);
+  return o->num + o->used;
+}
+
+static void putnum(struct out *o, int n) {
+  put(o, o->num + o->used, n);
+  o->used += n;
+}
+
+static void putc(struct out *o, char c) {
+  *numbuf(o) = c;
+  putnum(o, 1);
+}
+
+static void printint(struct out *o, int xx, int base, int sgn) {
+  char buf[16], *p;
+  int i, n, neg;
   uint x;
 
   neg = 0;
@@ -27,58 +67,67 @@ static void printint(int fd, int xx, int base, int sgn) {
   } while ((x /= base) != 0);
   if (neg) buf[i++] = '-';
 
-  while (--i >= 0) putc(fd, buf[i]);
+  p = numbuf(o);
+  for (n = 0; --i >= 0; n++) p[n] = buf[i];
+  putnum(o, n);
 }
 
-static void printptr(int fd, uint64 x) {
-  int i;
-  putc(fd, '0');
-  putc(fd, 'x');
-  for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4) putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
+static void printptr(struct out *o, uint64 x) {
+  char *p = numbuf(o);
+  int i, n = 0;
+
+  p[n++] = '0';
+  p[n++] = 'x';
+  for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4) p[n++] = digits[x >> (sizeof(uint64) * 8 - 4)];
+  putnum(o, n);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
 void vprintf(int fd, const char *fmt, va_list ap) {
+  struct out o;
   char *s;
-  int c, i, state;
+  int c, i, start, state;
 
+  o.fd = fd;
+  o.n = 0;
+  o.used = 0;
   state = 0;
+  start = 0;
   for (i = 0; fmt[i]; i++) {
     c = fmt[i] & 0xff;
     if (state == 0) {
       if (c == '%') {
+        put(&o, fmt + start, i - start);
         state = '%';
-      } else {
-        putc(fd, c);
       }
     } else if (state == '%') {
       if (c == 'd') {
-        printint(fd, va_arg(ap, int), 10, 1);
+        printint(&o, va_arg(ap, int), 10, 1);
       } else if (c == 'l') {
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(&o, va_arg(ap, uint64), 10, 0);
       } else if (c == 'x') {
-        printint(fd, va_arg(ap, int), 16, 0);
+        printint(&o, va_arg(ap, int), 16, 0);
       } else if (c == 'p') {
-        printptr(fd, va_arg(ap, uint64));
+        printptr(&o, va_arg(ap, uint64));
       } else if (c == 's') {
         s = va_arg(ap, char *);
         if (s == 0) s = "(null)";
-        while (*s != 0) {
-          putc(fd, *s);
-          s++;
-        }
+        put(&o, s, strlen(s));
       } else if (c == 'c') {
-        putc(fd, va_arg(ap, uint));
+        putc(&o, va_arg(ap, uint));
       } else if (c == '%') {
-        putc(fd, c);
+        putc(&o, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(&o, '%');
+        putc(&o, c);
       }
       state = 0;
+      start = i + 1;
     }
   }
+  if (state == 0) put(&o, fmt + start, i - start);
+  flush(&o);
 }
 
 void fprintf(int fd, const char *fmt, ...) {
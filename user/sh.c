@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC 1
@@ -12,6 +13,7 @@
 #define BACK 5
 
 #define MAXARGS 10
+#define MAXREDIR 5  // per command run by spawncmd(); see there
 
 struct cmd {
   int type;
@@ -52,6 +54,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
+void freecmd(struct cmd *);
 
 // Execute cmd.  Never returns.
 void runcmd(struct cmd *cmd) {
@@ -123,6 +126,82 @@ void runcmd(struct cmd *cmd) {
   exit(0);
 }
 
+// Can cmd be run by spawncmd()? It must be a pipeline of
+// commands with at most MAXREDIR redirections each.
+int spawnable(struct cmd *cmd) {
+  struct cmd *c;
+  int n;
+
+  for (;;) {
+    c = cmd->type == PIPE ? ((struct pipecmd *)cmd)->left : cmd;
+    for (n = 0; c->type == REDIR; n++) c = ((struct redircmd *)c)->cmd;
+    if (c->type != EXEC || ((struct execcmd *)c)->argv[0] == 0 || n > MAXREDIR) return 0;
+    if (cmd->type != PIPE) return 1;
+    cmd = ((struct pipecmd *)cmd)->right;
+  }
+}
+
+// Run cmd, which must be spawnable(), in children started with
+// spawn(), so that unlike fork() the shell's memory isn't copied.
+// The shell opens the pipes and redirected files, and each child
+// gets at most 5 + 2*MAXREDIR file actions.
+// Returns the number of children started.
+int spawncmd(struct cmd *cmd) {
+  struct spawnfa fa[SPAWN_MAX];
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  struct cmd *c;
+  int p[2], fds[MAXREDIR], in, nfa, nfd, n, ok, i;
+
+  n = 0;
+  in = -1;
+  for (;;) {
+    nfa = 0;
+    if (in >= 0) {
+      fa[nfa++] = (struct spawnfa){SPAWN_DUP2, in, 0};
+      fa[nfa++] = (struct spawnfa){SPAWN_CLOSE, in, 0};
+    }
+    p[0] = p[1] = -1;
+    if (cmd->type == PIPE) {
+      if (pipe(p) < 0) panic("pipe");
+      fa[nfa++] = (struct spawnfa){SPAWN_DUP2, p[1], 1};
+      fa[nfa++] = (struct spawnfa){SPAWN_CLOSE, p[0], 0};
+      fa[nfa++] = (struct spawnfa){SPAWN_CLOSE, p[1], 0};
+    }
+
+    // Outermost redirection first, as runcmd() does them.
+    ok = 1;
+    nfd = 0;
+    c = cmd->type == PIPE ? ((struct pipecmd *)cmd)->left : cmd;
+    for (; c->type == REDIR; c = rcmd->cmd) {
+      rcmd = (struct redircmd *)c;
+      if ((fds[nfd] = open(rcmd->file, rcmd->mode)) < 0) {
+        fprintf(2, "open %s failed\n", rcmd->file);
+        ok = 0;
+        break;
+      }
+      fa[nfa++] = (struct spawnfa){SPAWN_DUP2, fds[nfd], rcmd->fd};
+      fa[nfa++] = (struct spawnfa){SPAWN_CLOSE, fds[nfd], 0};
+      nfd++;
+    }
+
+    ecmd = (struct execcmd *)c;
+    if (ok) {
+      if (spawn(ecmd->argv[0], ecmd->argv, fa, nfa) < 0)
+        fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      else
+        n++;
+    }
+
+    for (i = 0; i < nfd; i++) close(fds[i]);
+    if (in >= 0) close(in);
+    if (p[1] >= 0) close(p[1]);
+    in = p[0];
+    if (cmd->type != PIPE) return n;
+    cmd = ((struct pipecmd *)cmd)->right;
+  }
+}
+
 int getcmd(char *buf, int nbuf) {
   fprintf(2, "$ ");
   memset(buf, 0, nbuf);
@@ -134,7 +213,8 @@ int getcmd(char *buf, int nbuf) {
 
 int main(void) {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while ((fd = open("console", O_RDWR)) >= 0) {
@@ -152,8 +232,14 @@ int main(void) {
       if (chdir(buf + 3) < 0) fprintf(2, "cannot cd %s\n", buf + 3);
       continue;
     }
-    if (fork1() == 0) runcmd(parsecmd(buf));
-    wait(0);
+    if ((cmd = parsecmd(buf)) == 0) continue;
+    if (spawnable(cmd)) {
+      for (n = spawncmd(cmd); n > 0; n--) wait(0);
+    } else {
+      if (fork1() == 0) runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -286,16 +372,30 @@ struct cmd *parsepipe(char **, char *);
 struct cmd *parseexec(char **, char *);
 struct cmd *nulterminate(struct cmd *);
 
+// The shell parses commands itself, so a syntax error must not
+// exit: report the first one, and parsecmd() returns 0.
+int parseerr;
+
+void syntax(char *s) {
+  if (!parseerr) fprintf(2, "%s\n", s);
+  parseerr = 1;
+}
+
 struct cmd *parsecmd(char *s) {
   char *es;
   struct cmd *cmd;
 
   es = s + strlen(s);
+  parseerr = 0;
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if (s != es) {
+  if (s != es && !parseerr) {
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if (parseerr) {
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -333,7 +433,10 @@ struct cmd *parseredirs(struct cmd *cmd, char **ps, char *es) {
 
   while (peek(ps, es, "<>")) {
     tok = gettoken(ps, es, 0, 0);
-    if (gettoken(ps, es, &q, &eq) != 'a') panic("missing file for redirection");
+    if (gettoken(ps, es, &q, &eq) != 'a') {
+      syntax("missing file for redirection");
+      break;
+    }
     switch (tok) {
       case '<':
         cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -355,7 +458,10 @@ struct cmd *parseblock(char **ps, char *es) {
   if (!peek(ps, es, "(")) panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if (!peek(ps, es, ")")) panic("syntax - missing )");
+  if (!peek(ps, es, ")")) {
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -376,11 +482,17 @@ struct cmd *parseexec(char **ps, char *es) {
   ret = parseredirs(ret, ps, es);
   while (!peek(ps, es, "|)&;")) {
     if ((tok = gettoken(ps, es, &q, &eq)) == 0) break;
-    if (tok != 'a') panic("syntax");
+    if (tok != 'a') {
+      syntax("syntax");
+      break;
+    }
+    if (argc >= MAXARGS - 1) {
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if (argc >= MAXARGS) panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -430,3 +542,29 @@ struct cmd *nulterminate(struct cmd *cmd) {
   }
   return cmd;
 }
+
+// Free a parsed command.
+void freecmd(struct cmd *cmd) {
+  if (cmd == 0) return;
+
+  switch (cmd->type) {
+    case REDIR:
+      freecmd(((struct redircmd *)cmd)->cmd);
+      break;
+
+    case PIPE:
+      freecmd(((struct pipecmd *)cmd)->left);
+      freecmd(((struct pipecmd *)cmd)->right);
+      break;
+
+    case LIST:
+      freecmd(((struct listcmd *)cmd)->left);
+      freecmd(((struct listcmd *)cmd)->right);
+      break;
+
+    case BACK:
+      freecmd(((struct backcmd *)cmd)->cmd);
+      break;
+  }
+  free(cmd);
+}
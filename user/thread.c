@@ -0,0 +1,64 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+// Threads on top of clone() and join(). Each thread runs on a
+// stack from malloc(), freed when it is joined. Neither malloc()
+// nor the table below is locked, so only one thread of a process
+// should create and join threads.
+
+#define STACKSIZE 8192
+
+struct start {
+  void (*fn)(void *);
+  void *arg;
+};
+
+static struct {
+  int tid;
+  char *stack;
+} threads[NPROC];
+
+static void start(void *a) {
+  struct start *s = a;
+
+  s->fn(s->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg).
+// Returns its id, or -1.
+int thread_create(void (*fn)(void *), void *arg) {
+  char *stack;
+  struct start *s;
+  int i, tid;
+
+  for (i = 0; i < NPROC && threads[i].stack; i++)
+    ;
+  if (i == NPROC || (stack = malloc(STACKSIZE)) == 0) return -1;
+  // fn and arg go at the top of the stack, which stays 16-byte aligned.
+  s = (struct start *)(stack + STACKSIZE) - 1;
+  s->fn = fn;
+  s->arg = arg;
+  if ((tid = clone(start, s, s)) < 0) {
+    free(stack);
+    return -1;
+  }
+  threads[i].tid = tid;
+  threads[i].stack = stack;
+  return tid;
+}
+
+// Wait for thread tid to exit and free its stack.
+// Returns tid, or -1.
+int thread_join(int tid) {
+  int i;
+
+  for (i = 0; i < NPROC && threads[i].tid != tid; i++)
+    ;
+  if (i == NPROC || threads[i].stack == 0 || join(tid, 0) != tid) return -1;
+  free(threads[i].stack);
+  threads[i].tid = 0;
+  threads[i].stack = 0;
+  return tid;
+}
@@ -0,0 +1,32 @@
+#include "kernel/types.h"
+#include "kernel/resource.h"
+#include "user/user.h"
+
+// Run a command and print the time and resources it used.
+int main(int argc, char *argv[]) {
+  struct rusage ru;
+  int pid, t0, status;
+
+  if (argc < 2) {
+    fprintf(2, "usage: time command [arg ...]\n");
+    exit(1);
+  }
+  t0 = uptime();
+  if ((pid = fork()) < 0) {
+    fprintf(2, "time: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "time: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  if (wait2(&status, &ru) < 0) {
+    fprintf(2, "time: wait failed\n");
+    exit(1);
+  }
+  printf("real %d ticks user %l us sys %l us\n", uptime() - t0, ru.utime, ru.stime);
+  printf("switches %l voluntary %l involuntary\n", ru.nvcsw, ru.nivcsw);
+  printf("faults %l syscalls %l blocks %l in %l out\n", ru.nfault, ru.nsyscall, ru.inblock, ru.oublock);
+  exit(status);
+}
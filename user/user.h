@@ -1,5 +1,9 @@
 struct stat;
+struct statfs;
 struct rtcdate;
+struct iovec;
+struct rusage;
+struct spawnfa;
 
 // system calls
 int fork(void);
@@ -23,6 +27,26 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int sendfile(int, int, uint*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int lseek(int, int, int);
+int fsync(int);
+int sync(void);
+int statfs(struct statfs*);
+int nanosleep(uint64);
+int getrusage(struct rusage*);
+int wait2(int*, struct rusage*);
+int sched_setaffinity(int, uint64);
+int sched_getaffinity(int, uint64*);
+int clone(void (*)(void*), void*, void*);
+int join(int, int*);
+int spawn(char*, char**, struct spawnfa*, int);
+int futex(int*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +64,22 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// thread.c
+int thread_create(void (*)(void*), void*);
+int thread_join(int);
+
+// mutex.c
+struct mutex {
+  int state;
+};
+struct cond {
+  int seq;
+};
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -4,6 +4,10 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/uio.h"
+#include "kernel/resource.h"
+#include "kernel/spawn.h"
+#include "kernel/futex.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -494,18 +498,78 @@ void writetest(char *s) {
   }
 }
 
+// a small file kept inline in its inode must move to blocks
+// as it grows, and become inline again when truncated.
+void inlinefile(char *s) {
+  enum { N = 2 * BSIZE + 3 };
+  static char buf[N];
+  int fd, i, n;
+
+  unlink("inlinefile");
+  fd = open("inlinefile", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf("%s: create inlinefile failed\n", s);
+    exit(1);
+  }
+  // grow a byte at a time up to and past NINLINE, then in one big step.
+  for (i = 0; i < NINLINE + 1; i++) {
+    buf[0] = 'a' + i % 26;
+    if (write(fd, buf, 1) != 1) {
+      printf("%s: write byte %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  for (i = NINLINE + 1; i < N; i++) buf[i - NINLINE - 1] = 'a' + i % 26;
+  if (write(fd, buf, N - NINLINE - 1) != N - NINLINE - 1) {
+    printf("%s: big write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("inlinefile", O_RDONLY);
+  memset(buf, 0, N);
+  if ((n = read(fd, buf, N)) != N) {
+    printf("%s: read %d bytes, wanted %d\n", s, n, N);
+    exit(1);
+  }
+  close(fd);
+  for (i = 0; i < N; i++) {
+    if (buf[i] != 'a' + i % 26) {
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  fd = open("inlinefile", O_RDWR | O_TRUNC);
+  if (write(fd, "xyz", 3) != 3) {
+    printf("%s: write after truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inlinefile", O_RDONLY);
+  n = read(fd, buf, N);
+  close(fd);
+  if (n != 3 || buf[0] != 'x' || buf[2] != 'z') {
+    printf("%s: read %d bytes after truncate\n", s, n);
+    exit(1);
+  }
+  unlink("inlinefile");
+}
+
 void writebig(char *s) {
-  int i, fd, n;
+  int i, fd, n, bsize;
+  struct stat st;
 
   fd = open("big", O_CREATE | O_RDWR);
-  if (fd < 0) {
+  if (fd < 0 || fstat(fd, &st) < 0) {
     printf("%s: error: creat big failed!\n", s);
     exit(1);
   }
+  bsize = st.blksize;
 
-  for (i = 0; i < MAXFILE; i++) {
+  for (i = 0; i < MAXFILE(bsize); i++) {
     ((int *)buf)[0] = i;
-    if (write(fd, buf, BSIZE) != BSIZE) {
+    if (write(fd, buf, bsize) != bsize) {
       printf("%s: error: write big file failed\n", i);
       exit(1);
     }
@@ -521,14 +585,14 @@ void writebig(char *s) {
 
   n = 0;
   for (;;) {
-    i = read(fd, buf, BSIZE);
+    i = read(fd, buf, bsize);
     if (i == 0) {
-      if (n == MAXFILE - 1) {
+      if (n == MAXFILE(bsize) - 1) {
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
       break;
-    } else if (i != BSIZE) {
+    } else if (i != bsize) {
       printf("%s: read failed %d\n", i);
       exit(1);
     }
@@ -1237,11 +1301,10 @@ void concreate(char *s) {
   enum { N = 40 };
   char file[3];
   int i, pid, n, fd;
+  static char blk[BSIZE];
   char fa[N];
-  struct {
-    ushort inum;
-    char name[DIRSIZ];
-  } de;
+  struct dirent *de;
+  int off, cc;
 
   file[0] = 'C';
   file[2] = '\0';
@@ -1273,20 +1336,23 @@ void concreate(char *s) {
   memset(fa, 0, sizeof(fa));
   fd = open(".", 0);
   n = 0;
-  while (read(fd, &de, sizeof(de)) > 0) {
-    if (de.inum == 0) continue;
-    if (de.name[0] == 'C' && de.name[2] == '\0') {
-      i = de.name[1] - '0';
-      if (i < 0 || i >= sizeof(fa)) {
-        printf("%s: concreate weird file %s\n", s, de.name);
-        exit(1);
-      }
-      if (fa[i]) {
-        printf("%s: concreate duplicate file %s\n", s, de.name);
-        exit(1);
+  while ((cc = read(fd, blk, BSIZE)) > 0) {
+    for (off = 0; off < cc; off += de->reclen) {
+      de = (struct dirent *)(blk + off);
+      if (de->inum == 0) continue;
+      if (de->name[0] == 'C' && de->namelen == 2) {
+        i = de->name[1] - '0';
+        if (i < 0 || i >= sizeof(fa)) {
+          printf("%s: concreate weird file %c%c\n", s, de->name[0], de->name[1]);
+          exit(1);
+        }
+        if (fa[i]) {
+          printf("%s: concreate duplicate file %c%c\n", s, de->name[0], de->name[1]);
+          exit(1);
+        }
+        fa[i] = 1;
+        n++;
       }
-      fa[i] = 1;
-      n++;
     }
   }
   close(fd);
@@ -1394,6 +1460,68 @@ void bigdir(char *s) {
   }
 }
 
+// a directory big enough to be indexed must still read
+// back linearly, with the index blocks invisible.
+void dirindex(char *s) {
+  static char blk[BSIZE];
+  int i, fd, n, off, cc, nf;
+  char name[13];
+  struct dirent *de;
+  struct stat st;
+
+  if (mkdir("dx") != 0 || chdir("dx") != 0 || stat(".", &st) < 0) {
+    printf("%s: mkdir dx failed\n", s);
+    exit(1);
+  }
+  // enough 12-byte names to fill three blocks.
+  nf = 3 * (st.blksize / DIRREC(12));
+  memset(name, 'x', 12);
+  name[12] = '\0';
+  for (i = 0; i < nf; i++) {
+    name[0] = 'y';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    if ((fd = open(name, O_CREATE | O_RDWR)) < 0) {
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  fd = open(".", O_RDONLY);
+  n = 0;
+  while ((cc = read(fd, blk, BSIZE)) > 0) {
+    for (off = 0; off < cc; off += de->reclen) {
+      de = (struct dirent *)(blk + off);
+      if (de->inum != 0) n++;
+    }
+  }
+  close(fd);
+  if (n != nf + 2) {
+    printf("%s: read %d entries, expected %d\n", s, n, nf + 2);
+    exit(1);
+  }
+
+  for (i = 0; i < nf; i++) {
+    name[0] = 'y';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if (unlink(name) != 0) {
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if (chdir("..") != 0 || unlink("dx") != 0) {
+    printf("%s: unlink dx failed\n", s);
+    exit(1);
+  }
+}
+
 void subdir(char *s) {
   int fd, cc;
 
@@ -1645,48 +1773,57 @@ void bigfile(char *s) {
   unlink("bigfile.dat");
 }
 
-void fourteen(char *s) {
+// names are no longer cut off at 14 bytes, and may be
+// up to DIRSIZ bytes long.
+void longname(char *s) {
+  char name[DIRSIZ + 2];
   int fd;
 
-  // DIRSIZ is 14.
-
-  if (mkdir("12345678901234") != 0) {
-    printf("%s: mkdir 12345678901234 failed\n", s);
+  if (mkdir("12345678901234") != 0 || mkdir("123456789012345") != 0) {
+    printf("%s: mkdir 12345678901234 or 123456789012345 failed\n", s);
+    exit(1);
+  }
+  fd = open("12345678901234/a", O_CREATE);
+  if (fd < 0) {
+    printf("%s: create 12345678901234/a failed\n", s);
     exit(1);
   }
-  if (mkdir("12345678901234/123456789012345") != 0) {
-    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+  close(fd);
+  fd = open("123456789012345/a", 0);
+  if (fd >= 0) {
+    printf("%s: open 123456789012345/a succeeded!\n", s);
     exit(1);
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+
+  memset(name, 'x', DIRSIZ);
+  name[DIRSIZ] = '\0';
+  fd = open(name, O_CREATE | O_RDWR);
   if (fd < 0) {
-    printf("%s: create 123456789012345/123456789012345/123456789012345 failed\n", s);
+    printf("%s: create %d-byte name failed\n", s, DIRSIZ);
     exit(1);
   }
   close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  fd = open(name, 0);
   if (fd < 0) {
-    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+    printf("%s: open %d-byte name failed\n", s, DIRSIZ);
     exit(1);
   }
   close(fd);
 
-  if (mkdir("12345678901234/12345678901234") == 0) {
-    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+  name[DIRSIZ] = 'x';
+  name[DIRSIZ + 1] = '\0';
+  fd = open(name, O_CREATE | O_RDWR);
+  if (fd >= 0) {
+    printf("%s: create %d-byte name succeeded!\n", s, DIRSIZ + 1);
     exit(1);
   }
-  if (mkdir("123456789012345/12345678901234") == 0) {
-    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+
+  name[DIRSIZ] = '\0';
+  if (unlink(name) != 0 || unlink("12345678901234/a") != 0 || unlink("12345678901234") != 0 ||
+      unlink("123456789012345") != 0) {
+    printf("%s: unlink failed\n", s);
     exit(1);
   }
-
-  // clean up
-  unlink("123456789012345/12345678901234");
-  unlink("12345678901234/12345678901234");
-  unlink("12345678901234/12345678901234/12345678901234");
-  unlink("123456789012345/123456789012345/123456789012345");
-  unlink("12345678901234/123456789012345");
-  unlink("12345678901234");
 }
 
 void rmdot(char *s) {
@@ -2076,6 +2213,758 @@ void sbrkarg(char *s) {
   }
 }
 
+// mmap() a file: pages are read in on demand, MAP_PRIVATE
+// changes stay private, and MAP_SHARED changes reach the file.
+void mmapfile(char *s) {
+  enum { N = 2 * PGSIZE + PGSIZE / 2 };
+  char *p, c;
+  int fd, i, pid, xstatus;
+
+  fd = open("mmapfile", O_CREATE | O_RDWR);
+  for (i = 0; i < N; i++) {
+    c = 'a' + i % 23;
+    if (write(fd, &c, 1) != 1) {
+      printf("%s: write mmapfile failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // a private mapping reads the file, with zeroes past its end,
+  // and may be written even though the file was opened read-only.
+  fd = open("mmapfile", O_RDONLY);
+  if (mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != (void *)-1) {
+    printf("%s: shared writable mapping of read-only file\n", s);
+    exit(1);
+  }
+  p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == (void *)-1) {
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < 3 * PGSIZE; i++) {
+    if (p[i] != (i < N ? 'a' + i % 23 : 0)) {
+      printf("%s: mmapfile byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  p[0] = 'X';
+
+  // a child gets a copy of the mapping.
+  pid = fork();
+  if (pid == 0) exit(p[0] == 'X' && p[PGSIZE] == 'a' + PGSIZE % 23 ? 0 : 1);
+  wait(&xstatus);
+  if (xstatus != 0) {
+    printf("%s: child saw wrong mapping\n", s);
+    exit(1);
+  }
+  if (munmap(p, N) != 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0) exit(p[0]);
+  wait(&xstatus);
+  if (xstatus != -1) {
+    printf("%s: unmapped memory still readable\n", s);
+    exit(1);
+  }
+
+  // a shared mapping writes back when unmapped piece by piece.
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == (void *)-1) {
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[0] = 'Y';
+  p[N - 1] = 'Z';
+  if (munmap(p + PGSIZE, PGSIZE) != 0 || munmap(p, PGSIZE) != 0 || munmap(p + 2 * PGSIZE, N - 2 * PGSIZE) != 0) {
+    printf("%s: munmap part failed\n", s);
+    exit(1);
+  }
+
+  // a system call may use a page that hasn't been touched yet,
+  // and exit() writes back too.
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  fd = open("mmapfile2", O_CREATE | O_RDWR);
+  if (p == (void *)-1 || write(fd, p + PGSIZE, 1) != 1) {
+    printf("%s: write from mapping failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  pid = fork();
+  if (pid == 0) {
+    p[PGSIZE + 1] = 'W';
+    exit(0);
+  }
+  wait(0);
+  munmap(p, N);
+
+  fd = open("mmapfile", O_RDONLY);
+  read(fd, buf, N);
+  close(fd);
+  if (buf[0] != 'Y' || buf[N - 1] != 'Z' || buf[PGSIZE + 1] != 'W') {
+    printf("%s: shared mapping not written back\n", s);
+    exit(1);
+  }
+  fd = open("mmapfile2", O_RDONLY);
+  read(fd, &c, 1);
+  close(fd);
+  if (c != 'a' + PGSIZE % 23) {
+    printf("%s: wrote wrong byte from mapping\n", s);
+    exit(1);
+  }
+  unlink("mmapfile2");
+  unlink("mmapfile");
+}
+
+// read() into a shared mapping, even an untouched one of the file
+// being read, reaches the file when the mapping is unmapped; a
+// read-only mapping can't be read() into.
+void mmapread(char *s) {
+  enum { N = 2 * PGSIZE };
+  char *p;
+  int fd, fd2, i;
+
+  fd = open("mmapread", O_CREATE | O_RDWR);
+  for (i = 0; i < N; i++) buf[i] = 'a' + i % 23;
+  if (fd < 0 || write(fd, buf, N) != N) {
+    printf("%s: write mmapread failed\n", s);
+    exit(1);
+  }
+  fd2 = open("mmapread2", O_CREATE | O_RDWR);
+  memset(buf, 'b', PGSIZE);
+  if (fd2 < 0 || write(fd2, buf, PGSIZE) != PGSIZE) {
+    printf("%s: write mmapread2 failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == (void *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, p + PGSIZE, PGSIZE) != PGSIZE || lseek(fd2, 0, SEEK_SET) != 0 ||
+      read(fd2, p, PGSIZE) != PGSIZE) {
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if (munmap(p, N) != 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, buf, N) != N) {
+    printf("%s: reread failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for (i = 0; i < N; i++) {
+    if (buf[i] != (i < PGSIZE ? 'b' : 'a' + (i - PGSIZE) % 23)) {
+      printf("%s: byte %d not written back\n", s, i);
+      exit(1);
+    }
+  }
+
+  // A read-only mapping can't be read() into, even once touched.
+  fd = open("mmapread", O_RDONLY);
+  fd2 = open("mmapread2", O_RDONLY);
+  p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (fd < 0 || fd2 < 0 || p == (void *)-1) {
+    printf("%s: read-only mmap failed\n", s);
+    exit(1);
+  }
+  if (p[0] != 'b' || read(fd2, p, 1) > 0) {
+    printf("%s: read into read-only mapping\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+  close(fd2);
+  close(fd);
+  unlink("mmapread2");
+  unlink("mmapread");
+}
+
+// sendfile() copies between files and into pipes.
+void sendfiletest(char *s) {
+  enum { N = 3 * 4096 + 100 };
+  int fd, fd2, fds[2], i, n;
+  uint off;
+
+  for (i = 0; i < N; i++) buf[i] = 'a' + i % 19;
+  fd = open("sendfile", O_CREATE | O_RDWR);
+  if (fd < 0 || write(fd, buf, N) != N) {
+    printf("%s: write sendfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("sendfile", O_RDONLY);
+  fd2 = open("sendfile2", O_CREATE | O_RDWR);
+  if (read(fd, buf, 10) != 10 || (n = sendfile(fd2, fd, 0, N)) != N - 10) {
+    printf("%s: sendfile to file returned %d\n", s, n);
+    exit(1);
+  }
+  if (sendfile(fd2, fd, 0, N) != 0 || sendfile(fd, fd, 0, N) != -1) {
+    printf("%s: sendfile past end or to itself\n", s);
+    exit(1);
+  }
+  close(fd2);
+  fd2 = open("sendfile2", O_RDONLY);
+  if (read(fd2, buf, N) != N - 10) {
+    printf("%s: sendfile2 wrong size\n", s);
+    exit(1);
+  }
+  close(fd2);
+  for (i = 0; i < N - 10; i++) {
+    if (buf[i] != 'a' + (i + 10) % 19) {
+      printf("%s: sendfile2 byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+
+  // an explicit offset leaves the file's own offset alone.
+  if (pipe(fds) != 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  off = 2 * 4096 - 3;
+  if (sendfile(fds[1], fd, &off, 100) != 100 || off != 2 * 4096 + 97 || read(fds[0], buf, 100) != 100) {
+    printf("%s: sendfile to pipe failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < 100; i++) {
+    if (buf[i] != 'a' + (2 * 4096 - 3 + i) % 19) {
+      printf("%s: pipe byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  if (sendfile(fds[1], fds[0], 0, 1) != -1 || read(fd, buf, 1) != 0) {
+    printf("%s: sendfile from pipe or offset wrong\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+  unlink("sendfile");
+  unlink("sendfile2");
+}
+
+// readv() and writev() scatter and gather.
+void iovtest(char *s) {
+  enum { N = 3 * 4096 };
+  static char a[N], b[N];
+  struct iovec iov[IOV_MAX + 1];
+  int fd, fds[2], i;
+
+  for (i = 0; i < N; i++) a[i] = 'a' + i % 13;
+  fd = open("iovfile", O_CREATE | O_RDWR);
+  // more than one log transaction's worth, in uneven pieces.
+  iov[0].iov_base = a;
+  iov[0].iov_len = 5;
+  iov[1].iov_base = a + 5;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = a + 5;
+  iov[2].iov_len = N - 5;
+  iov[3].iov_base = "xyz";
+  iov[3].iov_len = 3;
+  if (writev(fd, iov, 4) != N + 3) {
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if (writev(fd, iov, IOV_MAX + 1) != -1 || writev(fd, iov, -1) != -1) {
+    printf("%s: writev took bad count\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  iov[0].iov_base = b;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = b + 100;
+  iov[1].iov_len = N;
+  if (readv(fd, iov, 2) != N + 3 || readv(fd, iov, 2) != 0) {
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if (memcmp(a, b, N) != 0 || memcmp(b + N, "xyz", 3) != 0) {
+    printf("%s: readv read wrong data\n", s);
+    exit(1);
+  }
+  unlink("iovfile");
+
+  // a pipe readv returns what's there rather than block.
+  if (pipe(fds) != 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = "hello";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = " world";
+  iov[1].iov_len = 6;
+  if (writev(fds[1], iov, 2) != 11) {
+    printf("%s: writev to pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = b;
+  iov[0].iov_len = 20;
+  iov[1].iov_base = b + 20;
+  iov[1].iov_len = 20;
+  if (readv(fds[0], iov, 2) != 11 || memcmp(b, "hello world", 11) != 0) {
+    printf("%s: readv from pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// pread()/pwrite() leave the file offset alone; lseek() moves it.
+void preadtest(char *s) {
+  enum { N = 2 * 4096 };
+  int fd, i, pid, xstatus;
+  char c;
+
+  for (i = 0; i < N; i++) buf[i] = 'a' + i % 17;
+  fd = open("preadfile", O_CREATE | O_RDWR);
+  if (fd < 0 || write(fd, buf, N) != N) {
+    printf("%s: write preadfile failed\n", s);
+    exit(1);
+  }
+  if (lseek(fd, 0, SEEK_CUR) != N || lseek(fd, 1, SEEK_END) != -1 || lseek(fd, -1, SEEK_SET) != -1 ||
+      lseek(fd, 0, 3) != -1) {
+    printf("%s: lseek allowed bad offset\n", s);
+    exit(1);
+  }
+  if (pwrite(fd, "XY", 2, 4095) != 2 || pwrite(fd, "Z", 1, N + 1) != -1 || lseek(fd, 0, SEEK_CUR) != N) {
+    printf("%s: pwrite failed or moved offset\n", s);
+    exit(1);
+  }
+  if (lseek(fd, -3, SEEK_END) != N - 3 || write(fd, "end", 3) != 3) {
+    printf("%s: lseek then write failed\n", s);
+    exit(1);
+  }
+  buf[4095] = 'X';
+  buf[4096] = 'Y';
+  memmove(buf + N - 3, "end", 3);
+
+  // forked workers read the shared fd at random places.
+  for (i = 0; i < 4; i++) {
+    pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0) {
+      uint x = i + 1;
+      for (int j = 0; j < 200; j++) {
+        x = x * 1103515245 + 12345;
+        int off = (x >> 8) % N;
+        if (pread(fd, &c, 1, off) != 1 || c != buf[off]) exit(1);
+      }
+      exit(0);
+    }
+  }
+  for (i = 0; i < 4; i++) {
+    wait(&xstatus);
+    if (xstatus != 0) {
+      printf("%s: pread got wrong data\n", s);
+      exit(1);
+    }
+  }
+  if (lseek(fd, 0, SEEK_CUR) != N || pread(fd, &c, 1, N) != 0) {
+    printf("%s: pread moved offset\n", s);
+    exit(1);
+  }
+  if (lseek(fd, 4095, SEEK_SET) != 4095 || read(fd, &c, 1) != 1 || c != 'X') {
+    printf("%s: read after lseek wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadfile");
+}
+
+// file data that isn't logged (ordered-data mode) must read
+// back right through overwrites, truncation, and reuse of
+// blocks freed from directories.
+void ordereddata(char *s) {
+  enum { N = 20 * 1024 };
+  int fd, i, j, pid, xstatus;
+  char name[8];
+
+  for (i = 0; i < 3; i++) {
+    // a child frees directory blocks while the parent writes.
+    pid = fork();
+    if (pid == 0) {
+      mkdir("odir");
+      for (j = 0; j < 40; j++) {
+        name[0] = 'o';
+        name[1] = 'd';
+        name[2] = 'i';
+        name[3] = 'r';
+        name[4] = '/';
+        name[5] = 'a' + j % 26;
+        name[6] = 'A' + j / 26;
+        name[7] = 0;
+        close(open(name, O_CREATE | O_RDWR));
+      }
+      for (j = 0; j < 40; j++) {
+        name[5] = 'a' + j % 26;
+        name[6] = 'A' + j / 26;
+        unlink(name);
+      }
+      unlink("odir");
+      exit(0);
+    }
+
+    for (j = 0; j < N; j++) buf[j] = 'a' + (i + j) % 21;
+    fd = open("odata", O_CREATE | O_TRUNC | O_RDWR);
+    if (fd < 0 || write(fd, buf, N) != N || pwrite(fd, "ordered", 7, 4093) != 7) {
+      printf("%s: write odata failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    memmove(buf + 4093, "ordered", 7);
+    wait(&xstatus);
+    if (xstatus != 0) exit(xstatus);
+
+    fd = open("odata", O_RDONLY);
+    if (read(fd, buf + N, N) != N || memcmp(buf, buf + N, N) != 0) {
+      printf("%s: odata read back wrong\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  unlink("odata");
+}
+
+// fsync(), sync() and O_SYNC writes.
+void synctest(char *s) {
+  int fd, i;
+  char c;
+
+  fd = open("syncfile", O_CREATE | O_RDWR | O_SYNC);
+  if (fd < 0) {
+    printf("%s: open O_SYNC failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < 20; i++) {
+    c = 'a' + i;
+    if (write(fd, &c, 1) != 1) {
+      printf("%s: O_SYNC write failed\n", s);
+      exit(1);
+    }
+  }
+  if (fsync(fd) != 0 || fsync(-1) != -1 || fsync(NOFILE) != -1) {
+    printf("%s: fsync wrong result\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("syncfile");
+  if (sync() != 0) {
+    printf("%s: sync failed\n", s);
+    exit(1);
+  }
+  fd = open("syncfile", O_RDONLY);
+  if (fd >= 0) {
+    printf("%s: unlinked file still there after sync\n", s);
+    exit(1);
+  }
+}
+
+// statfs() tracks blocks and inodes as files come and go.
+void statfstest(char *s) {
+  struct statfs st0, st1, st2;
+  int fd, n;
+
+  if (statfs(&st0) != 0 || st0.bfree > st0.blocks || st0.ffree > st0.files) {
+    printf("%s: statfs failed\n", s);
+    exit(1);
+  }
+  n = 10 * st0.bsize;
+  fd = open("statfsfile", O_CREATE | O_RDWR);
+  if (fd < 0 || write(fd, buf, n) != n) {
+    printf("%s: write statfsfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  statfs(&st1);
+  if (st1.ffree != st0.ffree - 1 || st1.bfree > st0.bfree - 10) {
+    printf("%s: statfs didn't count new file: %d %d\n", s, st0.bfree - st1.bfree, st0.ffree - st1.ffree);
+    exit(1);
+  }
+  unlink("statfsfile");
+  statfs(&st2);
+  if (st2.ffree != st0.ffree || st2.bfree != st0.bfree) {
+    printf("%s: statfs didn't count removed file\n", s);
+    exit(1);
+  }
+}
+
+// sleep() and nanosleep() sleep for about as long as asked.
+void nanosleeptest(char *s) {
+  int t0, t1, i;
+
+  t0 = uptime();
+  if (sleep(3) != 0 || (t1 = uptime()) - t0 < 3) {
+    printf("%s: sleep(3) returned early\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  if (nanosleep(250000000) != 0 || (t1 = uptime()) - t0 < 2) {
+    printf("%s: nanosleep(250ms) returned early\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for (i = 0; i < 10; i++) {
+    if (nanosleep(1000000) != 0) {
+      printf("%s: nanosleep(1ms) failed\n", s);
+      exit(1);
+    }
+  }
+  if ((t1 = uptime()) - t0 > 5) {
+    printf("%s: ten nanosleep(1ms) took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
+// getrusage() and wait2() count system calls and sleeps.
+void rusagetest(char *s) {
+  struct rusage ru0, ru1;
+  int i, pid, status;
+
+  if (getrusage(&ru0) != 0) {
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < 100; i++) getpid();
+  sleep(1);
+  getrusage(&ru1);
+  if (ru1.nsyscall < ru0.nsyscall + 102 || ru1.nvcsw <= ru0.nvcsw || ru1.stime < ru0.stime) {
+    printf("%s: getrusage didn't count\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (i = 0; i < 100; i++) getpid();
+    exit(7);
+  }
+  if (wait2(&status, &ru1) != pid || status != 7) {
+    printf("%s: wait2 failed\n", s);
+    exit(1);
+  }
+  if (ru1.nsyscall < 101 || ru1.nsyscall > 110) {
+    printf("%s: wait2 child made %l syscalls\n", s, ru1.nsyscall);
+    exit(1);
+  }
+}
+
+// A process can be pinned to a CPU, and its children inherit that.
+void affinitytest(char *s) {
+  uint64 mask0, mask;
+  int pid, status;
+
+  if (sched_getaffinity(0, &mask0) != 0 || (mask0 & 1) == 0) {
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  if (sched_setaffinity(0, 0) != -1 || sched_setaffinity(0, 1UL << 63) != -1) {
+    printf("%s: sched_setaffinity accepted no running CPU\n", s);
+    exit(1);
+  }
+  if (sched_setaffinity(0, 1) != 0 || sched_getaffinity(0, &mask) != 0 || mask != 1) {
+    printf("%s: sched_setaffinity(1) failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    sleep(1);
+    exit(sched_getaffinity(0, &mask) == 0 && mask == 1 ? 0 : 1);
+  }
+  wait(&status);
+  if (status != 0 || sched_setaffinity(pid, 1) != -1) {
+    printf("%s: child didn't inherit affinity\n", s);
+    exit(1);
+  }
+  sched_setaffinity(0, mask0);
+}
+
+#define NCLONE 4
+int clonecount[NCLONE];
+int clonefd;
+
+void cloneworker(void *arg) {
+  int i = (int)(uint64)arg;
+
+  for (int j = 0; j < 1000; j++) clonecount[i]++;
+  write(clonefd, "x", 1);
+}
+
+void clonespin(void *arg) {
+  for (;;)
+    ;
+}
+
+int cloneopenfd;
+
+void cloneopen(void *arg) { cloneopenfd = open("clonefile", O_RDONLY); }
+
+// Threads share memory and their descriptor table, and are joined
+// by the process; an exiting process takes its threads with it.
+void clonetest(char *s) {
+  int tid[NCLONE], i, pid, status;
+  struct stat st;
+  char c;
+
+  clonefd = open("clonefile", O_CREATE | O_RDWR);
+  if (clonefd < 0) {
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < NCLONE; i++) {
+    if ((tid[i] = thread_create(cloneworker, (void *)(uint64)i)) < 0) {
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NCLONE; i++) {
+    if (thread_join(tid[i]) != tid[i] || clonecount[i] != 1000) {
+      printf("%s: thread %d didn't run\n", s, i);
+      exit(1);
+    }
+  }
+  if (fstat(clonefd, &st) < 0 || st.size != NCLONE) {
+    printf("%s: threads didn't share the file\n", s);
+    exit(1);
+  }
+  // A file a thread opens is open in the whole process.
+  if ((tid[0] = thread_create(cloneopen, 0)) < 0 || thread_join(tid[0]) != tid[0] || cloneopenfd < 0 ||
+      read(cloneopenfd, &c, 1) != 1 || close(cloneopenfd) != 0) {
+    printf("%s: threads didn't share the descriptor table\n", s);
+    exit(1);
+  }
+  close(clonefd);
+  unlink("clonefile");
+  if (join(0, 0) != -1 || wait(0) != -1) {
+    printf("%s: joined a missing thread\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    if (thread_create(clonespin, 0) < 0) exit(1);
+    if (exec("echo", (char *[]){"echo", 0}) != -1) exit(1);
+    exit(0);
+  }
+  if (wait(&status) != pid || status != 0) {
+    printf("%s: process with a thread didn't exit\n", s);
+    exit(1);
+  }
+}
+
+// spawn() starts a program in a new child, with its open files
+// changed by the file actions.
+void spawntest(char *s) {
+  struct spawnfa fa[2];
+  char *argv[] = {"echo", "spawned", 0};
+  char buf[16];
+  int fd, pid, status;
+
+  fd = open("spawnfile", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  fa[0] = (struct spawnfa){SPAWN_DUP2, fd, 1};
+  fa[1] = (struct spawnfa){SPAWN_CLOSE, fd, 0};
+  pid = spawn("echo", argv, fa, 2);
+  if (pid < 0) {
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  if (wait(&status) != pid || status != 0) {
+    printf("%s: spawned echo failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("spawnfile", O_RDONLY);
+  if (read(fd, buf, sizeof(buf)) != 8 || memcmp(buf, "spawned\n", 8) != 0) {
+    printf("%s: spawned echo wrote the wrong output\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("spawnfile");
+
+  fa[0] = (struct spawnfa){SPAWN_CLOSE, NOFILE - 1, 0};
+  if (spawn("nosuchprogram", argv, 0, 0) != -1 || spawn("echo", argv, fa, 1) != -1 || wait(0) != -1) {
+    printf("%s: bad spawn succeeded\n", s);
+    exit(1);
+  }
+}
+
+#define NFUTEX 4
+struct mutex futexmu;
+struct cond futexcv;
+int futexcount, futexturn;
+
+void futexworker(void *arg) {
+  int i, me = (int)(uint64)arg;
+
+  for (i = 0; i < 1000; i++) {
+    mutex_lock(&futexmu);
+    futexcount++;
+    mutex_unlock(&futexmu);
+  }
+  // Then take turns, in order.
+  mutex_lock(&futexmu);
+  while (futexturn != me) cond_wait(&futexcv, &futexmu);
+  futexturn++;
+  cond_broadcast(&futexcv);
+  mutex_unlock(&futexmu);
+}
+
+// Threads synchronize with futex()-based mutexes and condition
+// variables.
+void futextest(char *s) {
+  int tid[NFUTEX], i, word = 1;
+
+  if (futex(&word, FUTEX_WAIT, 0) != -1 || futex(&word, FUTEX_WAKE, 1) != 0 || futex(&word, 2, 0) != -1) {
+    printf("%s: futex on an unshared word misbehaved\n", s);
+    exit(1);
+  }
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  for (i = NFUTEX - 1; i >= 0; i--) {
+    if ((tid[i] = thread_create(futexworker, (void *)(uint64)i)) < 0) {
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NFUTEX; i++) thread_join(tid[i]);
+  if (futexcount != NFUTEX * 1000 || futexturn != NFUTEX) {
+    printf("%s: count %d turn %d\n", s, futexcount, futexturn);
+    exit(1);
+  }
+}
+
 void validatetest(char *s) {
   int hi;
   uint64 p;
@@ -2510,6 +3399,7 @@ int main(int argc, char *argv[]) {
       {unlinkread, "unlinkread"},
       {concreate, "concreate"},
       {subdir, "subdir"},
+      {dirindex, "dirindex"},
       {fourfiles, "fourfiles"},
       {sharedfd, "sharedfd"},
       {exectest, "exectest"},
@@ -2521,11 +3411,26 @@ int main(int argc, char *argv[]) {
       {kernmem, "kernmem"},
       {sbrkfail, "sbrkfail"},
       {sbrkarg, "sbrkarg"},
+      {mmapfile, "mmapfile"},
+      {mmapread, "mmapread"},
+      {sendfiletest, "sendfile"},
+      {iovtest, "iov"},
+      {preadtest, "pread"},
+      {ordereddata, "ordereddata"},
+      {synctest, "sync"},
+      {statfstest, "statfs"},
+      {nanosleeptest, "nanosleep"},
+      {rusagetest, "rusage"},
+      {affinitytest, "affinity"},
+      {clonetest, "clone"},
+      {spawntest, "spawn"},
+      {futextest, "futex"},
       {validatetest, "validatetest"},
       {stacktest, "stacktest"},
       {opentest, "opentest"},
       {writetest, "writetest"},
       {writebig, "writebig"},
+      {inlinefile, "inlinefile"},
       {createtest, "createtest"},
       {openiputtest, "openiput"},
       {exitiputtest, "exitiput"},
@@ -2535,7 +3440,7 @@ int main(int argc, char *argv[]) {
       {preempt, "preempt"},
       {exitwait, "exitwait"},
       {rmdot, "rmdot"},
-      {fourteen, "fourteen"},
+      {longname, "longname"},
       {bigfile, "bigfile"},
       {dirfile, "dirfile"},
       {iref, "iref"},
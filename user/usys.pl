@@ -36,3 +36,23 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("sendfile");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("lseek");
+entry("fsync");
+entry("sync");
+entry("statfs");
+entry("nanosleep");
+entry("getrusage");
+entry("wait2");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("clone");
+entry("join");
+entry("spawn");
+entry("futex");